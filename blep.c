@@ -0,0 +1,142 @@
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include "gb.h"
+
+/* Cutoff frequency of the kernel as a fraction of the output sample rate. A bit
+ * below Nyquist to leave some room for the transition band */
+#define GB_BLEP_CUTOFF 0.45
+
+/* Step kernels for every sub-sample phase. They don't depend on the sample
+ * rate so they're built once and shared by all the instances */
+static int16_t gb_blep_kernel[GB_BLEP_PHASES][GB_BLEP_WIDTH];
+static pthread_once_t gb_blep_kernel_once = PTHREAD_ONCE_INIT;
+
+/* Build the kernels: each one is a Blackman-windowed sinc (i.e. a band-limited
+ * impulse) shifted by a fraction of sample. Since we store deltas and
+ * integrate them afterwards, adding an impulse to the buffer results in a
+ * band-limited step in the output. */
+static void gb_blep_build_kernel(void) {
+     const double half_width = GB_BLEP_WIDTH / 2;
+     unsigned phase;
+
+     for (phase = 0; phase < GB_BLEP_PHASES; phase++) {
+          double frac = (double)phase / GB_BLEP_PHASES;
+          double taps[GB_BLEP_WIDTH];
+          double sum = 0;
+          int32_t isum = 0;
+          unsigned center = 0;
+          unsigned i;
+
+          for (i = 0; i < GB_BLEP_WIDTH; i++) {
+               double t = i - (GB_BLEP_WIDTH - 1) / 2. - frac;
+               double x = 2 * GB_BLEP_CUTOFF * t;
+               double v;
+
+               if (fabs(t) >= half_width) {
+                    taps[i] = 0;
+                    continue;
+               }
+
+               v = (x == 0) ? 1 : sin(M_PI * x) / (M_PI * x);
+               v *= 0.42 + 0.5 * cos(M_PI * t / half_width)
+                    + 0.08 * cos(2 * M_PI * t / half_width);
+
+               taps[i] = v;
+               sum += v;
+          }
+
+          /* Normalize so that the kernel's gain is exactly one, otherwise
+           * the integrated output would drift */
+          for (i = 0; i < GB_BLEP_WIDTH; i++) {
+               int16_t k = lround(taps[i] / sum * (1 << GB_BLEP_KERNEL_BITS));
+
+               gb_blep_kernel[phase][i] = k;
+               isum += k;
+
+               if (k > gb_blep_kernel[phase][center]) {
+                    center = i;
+               }
+          }
+
+          /* Dump the rounding error on the largest tap */
+          gb_blep_kernel[phase][center] += (1 << GB_BLEP_KERNEL_BITS) - isum;
+     }
+}
+
+void gb_blep_init(struct gb_blep *b, unsigned rate) {
+     b->deltas = calloc(GB_BLEP_DELTAS_FRAMES, sizeof(*b->deltas));
+     if (b->deltas == NULL) {
+          perror("Can't allocate BLEP buffer");
+          die();
+     }
+
+     b->rate = rate;
+     b->offset = 0;
+     b->integrator[0] = 0;
+     b->integrator[1] = 0;
+
+     gb_blep_set_period(b, ((uint64_t)GB_CPU_FREQ_HZ << GB_SPU_PERIOD_SHIFT)
+                        / rate);
+     pthread_once(&gb_blep_kernel_once, gb_blep_build_kernel);
+}
+
+void gb_blep_destroy(struct gb_blep *b) {
+     free(b->deltas);
+     b->deltas = NULL;
+}
+
+/* Set the duration of an output sample as a fixed point number of cycles (see
+ * GB_SPU_PERIOD_SHIFT) */
+void gb_blep_set_period(struct gb_blep *b, uint32_t period) {
+     b->factor = (1ULL << (32 + GB_SPU_PERIOD_SHIFT)) / period;
+}
+
+/* Returns the longest frame that can be buffered at once, in cycles */
+uint32_t gb_blep_max_frame_cycles(struct gb_blep *b) {
+     return ((uint64_t)(GB_BLEP_BUFFER_FRAMES - 1) << 32) / b->factor;
+}
+
+/* Add an amplitude transition `cycles` after the start of the current frame */
+void gb_blep_add_delta(struct gb_blep *b, uint32_t cycles,
+                       int32_t delta_l, int32_t delta_r) {
+     uint64_t pos = b->offset + cycles * b->factor;
+     unsigned index = pos >> 32;
+     unsigned phase = (pos >> (32 - GB_BLEP_PHASE_BITS)) &
+          (GB_BLEP_PHASES - 1);
+     const int16_t *k = gb_blep_kernel[phase];
+     int32_t (*d)[2] = b->deltas + index;
+     unsigned i;
+
+     for (i = 0; i < GB_BLEP_WIDTH; i++) {
+          d[i][0] += delta_l * k[i];
+          d[i][1] += delta_r * k[i];
+     }
+}
+
+/* End the current frame `cycles` after its start. All the samples that can no
+ * longer be modified by future transitions are written to `out_l` and `out_r`
+ * (which must be GB_BLEP_BUFFER_FRAMES long) and their number is returned. */
+unsigned gb_blep_end_frame(struct gb_blep *b, uint32_t cycles,
+                           int32_t *out_l, int32_t *out_r) {
+     uint64_t pos = b->offset + cycles * b->factor;
+     unsigned n = pos >> 32;
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          b->integrator[0] += b->deltas[i][0];
+          b->integrator[1] += b->deltas[i][1];
+
+          out_l[i] = b->integrator[0] >> GB_BLEP_KERNEL_BITS;
+          out_r[i] = b->integrator[1] >> GB_BLEP_KERNEL_BITS;
+     }
+
+     /* Move the tail of the buffer back to the start */
+     memmove(b->deltas, b->deltas + n,
+             (GB_BLEP_DELTAS_FRAMES - n) * sizeof(*b->deltas));
+     memset(b->deltas + GB_BLEP_DELTAS_FRAMES - n, 0, n * sizeof(*b->deltas));
+
+     b->offset = pos & 0xffffffff;
+
+     return n;
+}
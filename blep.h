@@ -0,0 +1,47 @@
+#ifndef _GB_BLEP_H_
+#define _GB_BLEP_H_
+
+/* Band-limited step synthesis. Instead of sampling the sound generators at
+ * regular intervals (which aliases badly since the Game Boy generates square
+ * waves) we record every amplitude transition with its exact cycle timestamp
+ * and render it as a band-limited step at the output sample rate. */
+
+/* The steps are quantized to 1 / 2^GB_BLEP_PHASE_BITS sample */
+#define GB_BLEP_PHASE_BITS 5
+#define GB_BLEP_PHASES (1U << GB_BLEP_PHASE_BITS)
+/* Number of output samples covered by a single step */
+#define GB_BLEP_WIDTH 16
+/* Number of fractional bits of the kernel coefficients */
+#define GB_BLEP_KERNEL_BITS 15
+/* Number of output sample frames that can be pending in the buffer */
+#define GB_BLEP_BUFFER_FRAMES 1024
+/* Total number of frames in the delta buffer. We need some room past the end
+ * of the last frame for the tail of the kernels */
+#define GB_BLEP_DELTAS_FRAMES (GB_BLEP_BUFFER_FRAMES + GB_BLEP_WIDTH)
+
+struct gb_blep {
+     /* Output sample rate */
+     unsigned rate;
+     /* Number of output samples per cycle as a 32.32 fixed point number */
+     uint64_t factor;
+     /* Position of the start of the current frame in the buffer as a 32.32
+      * fixed point number of samples. Only the fractional part is ever
+      * non-zero outside of a frame */
+     uint64_t offset;
+     /* Accumulated deltas for both stereo channels. The output is obtained by
+      * integrating these */
+     int32_t (*deltas)[2];
+     /* Running sum of the deltas for both stereo channels */
+     int32_t integrator[2];
+};
+
+void gb_blep_init(struct gb_blep *b, unsigned rate);
+void gb_blep_destroy(struct gb_blep *b);
+void gb_blep_set_period(struct gb_blep *b, uint32_t period);
+uint32_t gb_blep_max_frame_cycles(struct gb_blep *b);
+void gb_blep_add_delta(struct gb_blep *b, uint32_t cycles,
+                       int32_t delta_l, int32_t delta_r);
+unsigned gb_blep_end_frame(struct gb_blep *b, uint32_t cycles,
+                           int32_t *out_l, int32_t *out_r);
+
+#endif /* _GB_BLEP_H_ */
@@ -0,0 +1,454 @@
+#include <string.h>
+#include <unistd.h>
+#include "gb.h"
+
+struct gb_capture_buffer {
+     struct gb_capture_buffer *next;
+     /* Number of bytes used in `data` */
+     size_t len;
+     uint8_t data[];
+};
+
+static void *gb_capture_thread(void *arg) {
+     struct gb_capture *c = arg;
+
+     for (;;) {
+          struct gb_capture_buffer *b;
+
+          sem_wait(&c->ready);
+
+          pthread_mutex_lock(&c->lock);
+          b = c->queue_head;
+          if (b) {
+               c->queue_head = b->next;
+               if (c->queue_head == NULL) {
+                    c->queue_tail = NULL;
+               }
+          }
+          pthread_mutex_unlock(&c->lock);
+
+          if (b == NULL) {
+               /* Queue is empty, we've been asked to stop */
+               break;
+          }
+
+          if (fwrite(b->data, 1, b->len, c->file) != b->len) {
+               perror("Capture write failed");
+          }
+
+          pthread_mutex_lock(&c->lock);
+          b->next = c->free_list;
+          c->free_list = b;
+          pthread_mutex_unlock(&c->lock);
+
+          sem_post(&c->written);
+     }
+
+     fflush(c->file);
+
+     return NULL;
+}
+
+/* Get an empty buffer. If the writer lags behind we allocate a new one, unless
+ * we've reached `max_buffers` in which case we wait for the writer. */
+static struct gb_capture_buffer *gb_capture_get_buffer(struct gb_capture *c) {
+     struct gb_capture_buffer *b;
+
+     for (;;) {
+          pthread_mutex_lock(&c->lock);
+          b = c->free_list;
+          if (b) {
+               c->free_list = b->next;
+          }
+          pthread_mutex_unlock(&c->lock);
+
+          if (b) {
+               break;
+          }
+
+          if (c->nbuffers < c->max_buffers) {
+               b = malloc(sizeof(*b) + c->buffer_size);
+               if (b == NULL) {
+                    perror("Can't allocate capture buffer");
+                    die();
+               }
+               c->nbuffers++;
+               break;
+          }
+
+          sem_wait(&c->written);
+     }
+
+     b->next = NULL;
+     b->len = 0;
+
+     return b;
+}
+
+/* Queue the current buffer for writing */
+static void gb_capture_submit(struct gb_capture *c) {
+     struct gb_capture_buffer *b = c->cur;
+
+     pthread_mutex_lock(&c->lock);
+     if (c->queue_tail) {
+          c->queue_tail->next = b;
+     } else {
+          c->queue_head = b;
+     }
+     c->queue_tail = b;
+     pthread_mutex_unlock(&c->lock);
+
+     sem_post(&c->ready);
+
+     c->cur = gb_capture_get_buffer(c);
+}
+
+/* Open a capture stream to `path`, or to stdout if `path` is "-". The data is
+ * handed over to the writer thread in blocks of `buffer_size` bytes. At most
+ * `max_buffers` blocks can be allocated, once they're all waiting to be
+ * written `gb_capture_write` blocks. */
+void gb_capture_open(struct gb_capture *c, const char *path,
+                     size_t buffer_size, unsigned max_buffers) {
+     if (strcmp(path, "-") == 0) {
+          /* Take over stdout and send the emulator's own messages to stderr
+           * instead so that they don't end up in the middle of the data */
+          int fd = dup(STDOUT_FILENO);
+
+          fflush(stdout);
+          if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+               perror("Can't redirect stdout");
+               die();
+          }
+
+          c->file = fdopen(fd, "wb");
+          if (c->file == NULL) {
+               perror("Can't open stdout for capture");
+               die();
+          }
+          c->is_stdout = true;
+     } else {
+          c->file = fopen(path, "wb");
+          if (c->file == NULL) {
+               perror("Can't open capture file");
+               die();
+          }
+          c->is_stdout = false;
+     }
+
+     c->queue_head = NULL;
+     c->queue_tail = NULL;
+     c->free_list = NULL;
+     c->size = 0;
+     c->buffer_size = buffer_size;
+     c->max_buffers = max_buffers;
+     c->nbuffers = 0;
+
+     pthread_mutex_init(&c->lock, NULL);
+     sem_init(&c->ready, 0, 0);
+     sem_init(&c->written, 0, 0);
+
+     c->cur = gb_capture_get_buffer(c);
+
+     if (pthread_create(&c->thread, NULL, gb_capture_thread, c)) {
+          perror("Can't create capture thread");
+          die();
+     }
+
+     c->running = true;
+}
+
+void gb_capture_write(struct gb_capture *c, const void *data, size_t len) {
+     const uint8_t *d = data;
+
+     c->size += len;
+
+     while (len) {
+          struct gb_capture_buffer *b = c->cur;
+          size_t n = c->buffer_size - b->len;
+
+          if (n > len) {
+               n = len;
+          }
+
+          memcpy(b->data + b->len, d, n);
+          b->len += n;
+          d += n;
+          len -= n;
+
+          if (b->len == c->buffer_size) {
+               gb_capture_submit(c);
+          }
+     }
+}
+
+/* Write all the pending data and stop the writer thread. After this call
+ * `c->file` can be accessed directly. */
+void gb_capture_flush(struct gb_capture *c) {
+     struct gb_capture_buffer *b;
+
+     if (!c->running) {
+          return;
+     }
+
+     if (c->cur->len) {
+          gb_capture_submit(c);
+     }
+
+     /* Wake the thread up with an empty queue to make it quit */
+     sem_post(&c->ready);
+     pthread_join(c->thread, NULL);
+     c->running = false;
+
+     free(c->cur);
+     c->cur = NULL;
+
+     while ((b = c->free_list)) {
+          c->free_list = b->next;
+          free(b);
+     }
+
+     pthread_mutex_destroy(&c->lock);
+     sem_destroy(&c->ready);
+     sem_destroy(&c->written);
+}
+
+void gb_capture_close(struct gb_capture *c) {
+     gb_capture_flush(c);
+
+     fclose(c->file);
+     c->file = NULL;
+}
+
+static void gb_capture_put_le(uint8_t *p, uint32_t v, unsigned bytes) {
+     unsigned i;
+
+     for (i = 0; i < bytes; i++) {
+          p[i] = v >> (i * 8);
+     }
+}
+
+/* Build a WAV header for 16bit stereo PCM. If the size of the data is not
+ * known yet we use the maximum value, which most programs interpret as "read
+ * until the end of the stream" */
+static void gb_audio_capture_wav_header(uint8_t header[44],
+                                        unsigned sample_rate,
+                                        uint32_t data_size) {
+     memcpy(header, "RIFF", 4);
+     gb_capture_put_le(header + 4,
+                       data_size == UINT32_MAX ? UINT32_MAX : data_size + 36,
+                       4);
+     memcpy(header + 8, "WAVE", 4);
+     memcpy(header + 12, "fmt ", 4);
+     /* Size of the fmt chunk */
+     gb_capture_put_le(header + 16, 16, 4);
+     /* PCM */
+     gb_capture_put_le(header + 20, 1, 2);
+     /* Stereo */
+     gb_capture_put_le(header + 22, 2, 2);
+     gb_capture_put_le(header + 24, sample_rate, 4);
+     /* Bytes per second */
+     gb_capture_put_le(header + 28, sample_rate * 4, 4);
+     /* Bytes per frame */
+     gb_capture_put_le(header + 32, 4, 2);
+     /* Bits per sample */
+     gb_capture_put_le(header + 34, 16, 2);
+     memcpy(header + 36, "data", 4);
+     gb_capture_put_le(header + 40, data_size, 4);
+}
+
+/* Start capturing the SPU's output to `path`. If the file name ends in ".wav"
+ * we write a WAV file, otherwise raw 16bit stereo PCM in the host's byte
+ * order. The output is exactly what's sent to the frontend, so it's
+ * bit-identical across runs as long as the emulation itself is (i.e. without
+ * dynamic rate control). */
+void gb_audio_capture_open(struct gb *gb, const char *path) {
+     struct gb_audio_capture *ac;
+     size_t len = strlen(path);
+
+     ac = malloc(sizeof(*ac));
+     if (ac == NULL) {
+          perror("Malloc failed");
+          die();
+     }
+
+     ac->wav = len >= 4 && strcmp(path + len - 4, ".wav") == 0;
+     ac->sample_rate = gb->spu.sample_rate;
+
+     gb_capture_open(&ac->stream, path, GB_CAPTURE_AUDIO_BUFFER_SIZE,
+                     GB_CAPTURE_AUDIO_QUEUE_BUFFERS);
+
+     if (ac->wav) {
+          uint8_t header[44];
+
+          /* WAV files are little endian, so are the samples on all the hosts
+           * we care about */
+          gb_audio_capture_wav_header(header, ac->sample_rate, UINT32_MAX);
+          gb_capture_write(&ac->stream, header, sizeof(header));
+     }
+
+     gb->spu.audio_capture = ac;
+}
+
+void gb_audio_capture_close(struct gb *gb) {
+     struct gb_audio_capture *ac = gb->spu.audio_capture;
+
+     if (ac == NULL) {
+          return;
+     }
+
+     gb_capture_flush(&ac->stream);
+
+     if (ac->wav && !ac->stream.is_stdout) {
+          /* Now that we know the size of the data, fix the header */
+          uint8_t header[44];
+          uint64_t data_size = ac->stream.size - sizeof(header);
+
+          if (data_size > UINT32_MAX - 36) {
+               data_size = UINT32_MAX - 36;
+          }
+
+          gb_audio_capture_wav_header(header, ac->sample_rate, data_size);
+
+          if (fseek(ac->stream.file, 0, SEEK_SET) == 0) {
+               fwrite(header, 1, sizeof(header), ac->stream.file);
+          }
+     }
+
+     gb_capture_close(&ac->stream);
+
+     free(ac);
+     gb->spu.audio_capture = NULL;
+}
+
+/* Size of a frame in the capture stream, not counting the Y4M frame header */
+#define GB_VIDEO_CAPTURE_FRAME_SIZE (GB_LCD_WIDTH * GB_LCD_HEIGHT * 3)
+
+/* Start capturing every frame sent to the frontend to `path`. If the file name
+ * ends in ".y4m" we write a YUV4MPEG2 stream, otherwise raw 24bit RGB
+ * frames. The frame buffer must use the RGB565 or xRGB8888 format. */
+void gb_video_capture_open(struct gb *gb, const char *path) {
+     struct gb_video_capture *vc;
+     size_t len = strlen(path);
+
+     if (gb->frontend.fb.format == GB_PIXEL_INDEXED8) {
+          fprintf(stderr, "Video capture is not supported by this "
+                  "frontend\n");
+          die();
+     }
+
+     vc = malloc(sizeof(*vc));
+     if (vc == NULL) {
+          perror("Malloc failed");
+          die();
+     }
+
+     if (len >= 4 && strcmp(path + len - 4, ".y4m") == 0) {
+          vc->format = GB_VIDEO_CAPTURE_Y4M;
+     } else {
+          vc->format = GB_VIDEO_CAPTURE_RGB24;
+     }
+
+     vc->frames = 0;
+
+     /* One buffer per frame, so that the queue is bounded in frames */
+     gb_capture_open(&vc->stream, path,
+                     GB_VIDEO_CAPTURE_FRAME_SIZE + 6,
+                     GB_CAPTURE_VIDEO_QUEUE_FRAMES);
+
+     if (vc->format == GB_VIDEO_CAPTURE_Y4M) {
+          char header[128];
+          int n;
+
+          /* The LCD refreshes every 70224 cycles, i.e. about 59.73Hz */
+          n = snprintf(header, sizeof(header),
+                       "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n",
+                       GB_LCD_WIDTH, GB_LCD_HEIGHT,
+                       GB_CPU_FREQ_HZ, 70224U);
+          gb_capture_write(&vc->stream, header, n);
+     }
+
+     gb->gpu.video_capture = vc;
+}
+
+/* Get the color of pixel `x` of `line` as 8bit RGB */
+static void gb_video_capture_pixel(const struct gb_framebuffer *fb,
+                                   const uint8_t *line, unsigned x,
+                                   uint8_t rgb[3]) {
+     if (fb->format == GB_PIXEL_RGB565) {
+          uint16_t p = ((const uint16_t *)line)[x];
+          unsigned r = p >> 11;
+          unsigned g = (p >> 5) & 0x3f;
+          unsigned b = p & 0x1f;
+
+          rgb[0] = (r << 3) | (r >> 2);
+          rgb[1] = (g << 2) | (g >> 4);
+          rgb[2] = (b << 3) | (b >> 2);
+     } else {
+          uint32_t p = ((const uint32_t *)line)[x];
+
+          rgb[0] = p >> 16;
+          rgb[1] = p >> 8;
+          rgb[2] = p;
+     }
+}
+
+/* Called on every flip to capture the frame currently in the frame buffer */
+void gb_video_capture_frame(struct gb *gb) {
+     struct gb_video_capture *vc = gb->gpu.video_capture;
+     const struct gb_framebuffer *fb = &gb->frontend.fb;
+     uint8_t frame[GB_VIDEO_CAPTURE_FRAME_SIZE];
+     const unsigned plane = GB_LCD_WIDTH * GB_LCD_HEIGHT;
+     unsigned x, y;
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          const uint8_t *line = (const uint8_t *)fb->pixels + y * fb->pitch;
+
+          for (x = 0; x < GB_LCD_WIDTH; x++) {
+               unsigned i = y * GB_LCD_WIDTH + x;
+               uint8_t rgb[3];
+               int r, g, b;
+
+               gb_video_capture_pixel(fb, line, x, rgb);
+
+               if (vc->format == GB_VIDEO_CAPTURE_RGB24) {
+                    frame[i * 3 + 0] = rgb[0];
+                    frame[i * 3 + 1] = rgb[1];
+                    frame[i * 3 + 2] = rgb[2];
+                    continue;
+               }
+
+               /* BT.601 studio range, one chroma sample per pixel */
+               r = rgb[0];
+               g = rgb[1];
+               b = rgb[2];
+               frame[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+               frame[plane + i] =
+                    ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+               frame[plane * 2 + i] =
+                    ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+          }
+     }
+
+     if (vc->format == GB_VIDEO_CAPTURE_Y4M) {
+          gb_capture_write(&vc->stream, "FRAME\n", 6);
+     }
+
+     gb_capture_write(&vc->stream, frame, sizeof(frame));
+
+     vc->frames++;
+}
+
+void gb_video_capture_close(struct gb *gb) {
+     struct gb_video_capture *vc = gb->gpu.video_capture;
+
+     if (vc == NULL) {
+          return;
+     }
+
+     gb_capture_close(&vc->stream);
+
+     printf("Captured %u video frames\n", vc->frames);
+
+     free(vc);
+     gb->gpu.video_capture = NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef _GB_CAPTURE_H_
+#define _GB_CAPTURE_H_
+
+/* Size of the audio buffers handed over to the writer thread */
+#define GB_CAPTURE_AUDIO_BUFFER_SIZE (256 * 1024)
+/* Maximum number of audio buffers waiting to be written: 16MiB, or about a
+ * minute of audio at 65536Hz */
+#define GB_CAPTURE_AUDIO_QUEUE_BUFFERS 64
+/* Maximum number of frames waiting to be written to the video capture */
+#define GB_CAPTURE_VIDEO_QUEUE_FRAMES 16
+
+struct gb_capture_buffer;
+
+/* Stream of data written to a file by a background thread. The emulation
+ * thread fills a buffer while the writer thread writes the previous one. If
+ * the writer falls behind new buffers are allocated and queued, up to
+ * `max_buffers`, after that the emulation thread waits for the writer. */
+struct gb_capture {
+     FILE *file;
+     /* True if we write to stdout (and therefore can't seek) */
+     bool is_stdout;
+     /* True while the writer thread is running */
+     bool running;
+     pthread_t thread;
+     /* Protects the queue and free list */
+     pthread_mutex_t lock;
+     /* Posted once for every queued buffer, and one last time to stop the
+      * writer thread */
+     sem_t ready;
+     /* Posted every time a buffer has been written */
+     sem_t written;
+     /* Buffers waiting to be written */
+     struct gb_capture_buffer *queue_head;
+     struct gb_capture_buffer *queue_tail;
+     /* Buffers already written which can be reused */
+     struct gb_capture_buffer *free_list;
+     /* Buffer being filled by the emulation thread */
+     struct gb_capture_buffer *cur;
+     /* Size of each buffer in bytes */
+     size_t buffer_size;
+     /* Maximum number of buffers */
+     unsigned max_buffers;
+     /* Number of buffers currently allocated */
+     unsigned nbuffers;
+     /* Total number of bytes submitted */
+     uint64_t size;
+};
+
+enum gb_video_capture_format {
+     /* YUV4MPEG2 stream, 4:4:4 */
+     GB_VIDEO_CAPTURE_Y4M,
+     /* Raw 24bit RGB frames */
+     GB_VIDEO_CAPTURE_RGB24,
+};
+
+struct gb_video_capture {
+     struct gb_capture stream;
+     enum gb_video_capture_format format;
+     /* Number of frames captured so far */
+     unsigned frames;
+};
+
+struct gb_audio_capture {
+     struct gb_capture stream;
+     /* True if we output a WAV file, otherwise raw PCM */
+     bool wav;
+     unsigned sample_rate;
+};
+
+void gb_capture_open(struct gb_capture *c, const char *path,
+                     size_t buffer_size, unsigned max_buffers);
+void gb_capture_write(struct gb_capture *c, const void *data, size_t len);
+void gb_capture_flush(struct gb_capture *c);
+void gb_capture_close(struct gb_capture *c);
+
+void gb_audio_capture_open(struct gb *gb, const char *path);
+void gb_audio_capture_close(struct gb *gb);
+
+void gb_video_capture_open(struct gb *gb, const char *path);
+void gb_video_capture_frame(struct gb *gb);
+void gb_video_capture_close(struct gb *gb);
+
+#endif /* _GB_CAPTURE_H_ */
@@ -2,7 +2,12 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "gb.h"
 
 /* 16KB ROM banks */
@@ -23,12 +28,19 @@
 #define GB_CART_OFF_ROM_BANKS 0x148
 #define GB_CART_OFF_RAM_BANKS 0x149
 
-static void gb_cart_get_rom_title(struct gb *gb, char title[17]) {
-     struct gb_cart *cart = &gb->cart;
+/* Granularity of the dirty tracking of mapped save files */
+#define GB_CART_SAVE_PAGE_SIZE 4096U
+
+/* Process-wide cache of the ROM images currently in use */
+static pthread_mutex_t gb_cart_rom_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gb_cart_rom *gb_cart_rom_cache = NULL;
+
+static void gb_cart_get_rom_title(const struct gb_cart_rom *rom,
+                                  char title[17]) {
      unsigned i;
 
      for (i = 0; i < 16; i++) {
-          char c = cart->rom[GB_CART_OFF_TITLE + i];
+          char c = rom->data[GB_CART_OFF_TITLE + i];
 
           if (c == 0) {
                /* End-of-title */
@@ -46,187 +58,679 @@ static void gb_cart_get_rom_title(struct gb *gb, char title[17]) {
      title[i] = '\0';
 }
 
-void gb_cart_load(struct gb *gb, const char *rom_path) {
+/* Layout of the save file of the cartridge */
+static void gb_cart_save_layout(struct gb *gb, struct gb_save_layout *l) {
+     struct gb_cart *cart = &gb->cart;
+
+     l->rom_crc = cart->image->crc;
+     l->rom_length = cart->rom_length;
+     l->ram_length = cart->ram_length;
+     l->rtc_length = cart->has_rtc ? GB_RTC_DUMP_SIZE : 0;
+}
+
+/* Map the save file in memory and use its RAM block directly as the cart RAM.
+ * `status` is the result of the `gb_save_read` that loaded the current RAM and
+ * RTC state. Returns 0 on success, -1 on error. */
+static int gb_cart_map_save(struct gb *gb, const struct gb_save_layout *l,
+                            enum gb_save_status status) {
+     struct gb_cart *cart = &gb->cart;
+     size_t length = gb_save_size(l);
+     uint8_t *map;
+     int fd;
+
+     if (status != GB_SAVE_CONTAINER) {
+          /* New and raw saves are converted to the container first, the
+           * file is replaced atomically so the raw save can't be lost */
+          uint8_t rtc[GB_RTC_DUMP_SIZE];
+          uint8_t *buf;
+          int ret;
+
+          buf = malloc(length);
+          if (buf == NULL) {
+               perror("malloc failed");
+               return -1;
+          }
+
+          if (cart->has_rtc) {
+               gb_rtc_dump(gb, rtc);
+          }
+
+          gb_save_pack(buf, l, cart->ram, rtc);
+          gb_save_seal(buf, l);
+          ret = gb_save_write_file(cart->save_file, buf, length);
+          free(buf);
+          if (ret < 0) {
+               return -1;
+          }
+     }
+
+     fd = open(cart->save_file, O_RDWR);
+     if (fd < 0) {
+          fprintf(stderr, "Can't open save file '%s': %s\n",
+                  cart->save_file, strerror(errno));
+          return -1;
+     }
+
+     map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) {
+          perror("Can't map save file");
+          return -1;
+     }
+
+     /* Until we exit cleanly the CRC can lag behind the RAM modified by the
+      * game, the flag must be on disk before that happens */
+     gb_save_set_mapped(map, true);
+     gb_save_seal(map, l);
+     if (msync(map, length, MS_SYNC) < 0) {
+          perror("msync failed");
+          munmap(map, length);
+          return -1;
+     }
+
+     free(cart->ram);
+     cart->ram = cart->ram_length ? map + GB_SAVE_HEADER_SIZE : NULL;
+     cart->save_map = map;
+     cart->save_map_length = length;
+     cart->dirty_pages = 0;
+
+     return 0;
+}
+
+/* Schedule the write back of the modified pages of the mapped save file. With
+ * `MS_ASYNC` this doesn't wait for the I/O to complete. */
+static void gb_cart_flush_save_map(struct gb *gb, int flags) {
      struct gb_cart *cart = &gb->cart;
-     FILE *f = fopen(rom_path, "rb");
-     long l;
-     size_t nread;
-     char rom_title[17];
-     bool has_battery_backup;
+     size_t sys_page = sysconf(_SC_PAGESIZE);
+     size_t tail = GB_SAVE_HEADER_SIZE + cart->ram_length;
+     struct gb_save_layout layout;
+     unsigned npages;
+     unsigned p;
+
+     /* The RTC state and the CRC that follow the RAM change with every
+      * flush */
+     if (cart->has_rtc) {
+          gb_rtc_dump(gb, cart->save_map + tail);
+     }
+     gb_cart_save_layout(gb, &layout);
+     gb_save_seal(cart->save_map, &layout);
+
+     /* `dirty_pages` tracks the pages of the RAM, which starts after the
+      * header in the file */
+     npages = (cart->ram_length + GB_CART_SAVE_PAGE_SIZE - 1) /
+          GB_CART_SAVE_PAGE_SIZE;
+
+     for (p = 0; p < npages; p++) {
+          size_t start;
+          size_t end;
+
+          if (!(cart->dirty_pages & (1ULL << p))) {
+               continue;
+          }
+
+          /* Coalesce the contiguous dirty pages */
+          start = p * GB_CART_SAVE_PAGE_SIZE;
+          while (p + 1 < npages && (cart->dirty_pages & (1ULL << (p + 1)))) {
+               p++;
+          }
+          end = (p + 1) * GB_CART_SAVE_PAGE_SIZE;
+          if (end > cart->ram_length) {
+               end = cart->ram_length;
+          }
+
+          start += GB_SAVE_HEADER_SIZE;
+          end += GB_SAVE_HEADER_SIZE;
+
+          /* msync wants an address aligned on the system's page size */
+          start &= ~(sys_page - 1);
+
+          if (msync(cart->save_map + start, end - start, flags) < 0) {
+               perror("msync failed");
+          }
+     }
+
+     tail &= ~(sys_page - 1);
+     if (msync(cart->save_map + tail, cart->save_map_length - tail,
+               flags) < 0) {
+          perror("msync failed");
+     }
+
+     cart->dirty_pages = 0;
+}
+
+/* Read the ROM from a file we can't map, such as a pipe. We read one byte past
+ * GB_CART_MAX_SIZE at most so that the caller can tell that the file is too
+ * big. Returns 0 on success, -1 on error. */
+static int gb_cart_rom_read(struct gb_cart_rom *rom, int fd) {
+     uint8_t *buf = NULL;
+     size_t cap = 0;
+     size_t len = 0;
+
+     for (;;) {
+          ssize_t n;
+
+          if (len == cap) {
+               uint8_t *b;
+
+               if (cap > GB_CART_MAX_SIZE) {
+                    break;
+               }
+
+               cap = cap ? cap * 2 : GB_CART_MIN_SIZE;
+               if (cap > GB_CART_MAX_SIZE) {
+                    cap = GB_CART_MAX_SIZE + 1;
+               }
+
+               b = realloc(buf, cap);
+               if (b == NULL) {
+                    perror("Can't allocate ROM buffer");
+                    free(buf);
+                    return -1;
+               }
+               buf = b;
+          }
+
+          n = read(fd, buf + len, cap - len);
+          if (n < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               perror("Failed to load ROM file");
+               free(buf);
+               return -1;
+          }
+
+          if (n == 0) {
+               break;
+          }
+
+          len += n;
+     }
+
+     rom->data = buf;
+     rom->length = len;
+     rom->mapped = false;
+
+     return 0;
+}
+
+/* Load the ROM from `fd`. Regular files are mapped read-only so that all the
+ * instances running the same ROM share the page cache instead of each having
+ * its own copy. Returns 0 on success, -1 on error. */
+static int gb_cart_rom_load_fd(struct gb_cart_rom *rom, int fd) {
+     struct stat st;
+
+     if (fstat(fd, &st) < 0) {
+          perror("Can't stat ROM file");
+          return -1;
+     }
+
+     if (S_ISREG(st.st_mode) &&
+         st.st_size > 0 && st.st_size <= GB_CART_MAX_SIZE) {
+          void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+          if (map != MAP_FAILED) {
+               rom->data = map;
+               rom->length = st.st_size;
+               rom->mapped = true;
+               return 0;
+          }
+
+          /* Fall back to reading the file */
+     }
+
+     return gb_cart_rom_read(rom, fd);
+}
+
+static void gb_cart_rom_free(struct gb_cart_rom *rom) {
+     if (rom->data == NULL) {
+          return;
+     }
+
+     if (rom->mapped) {
+          munmap(rom->data, rom->length);
+     } else {
+          free(rom->data);
+     }
+
+     rom->data = NULL;
+}
+
+/* Inflate a zlib or gzip stream (depending on `window_bits`) into a newly
+ * allocated ROM buffer. `size_hint` is the expected size of the output, or 0
+ * if unknown. Returns 0 on success, -1 on error. */
+static int gb_cart_rom_inflate(struct gb_cart_rom *rom,
+                               const uint8_t *data, size_t len,
+                               int window_bits, size_t size_hint) {
+     z_stream zs;
+     uint8_t *buf = NULL;
+     size_t cap;
+     int ret;
+
+     memset(&zs, 0, sizeof(zs));
+     if (inflateInit2(&zs, window_bits) != Z_OK) {
+          fprintf(stderr, "Can't initialize zlib\n");
+          return -1;
+     }
+
+     zs.next_in = (Bytef *)data;
+     zs.avail_in = len;
+
+     /* One extra byte so that zlib can report the end of the stream without
+      * having to grow the buffer, and so that we stop one byte past the
+      * maximum size and the caller can tell that the ROM is too big */
+     cap = size_hint ? size_hint + 1 : GB_CART_MIN_SIZE;
+     if (cap > GB_CART_MAX_SIZE + 1) {
+          cap = GB_CART_MAX_SIZE + 1;
+     }
+
+     buf = malloc(cap);
+     if (buf == NULL) {
+          perror("Can't allocate ROM buffer");
+          inflateEnd(&zs);
+          return -1;
+     }
+
+     for (;;) {
+          zs.next_out = buf + zs.total_out;
+          zs.avail_out = cap - zs.total_out;
+
+          ret = inflate(&zs, Z_NO_FLUSH);
+          if (ret != Z_OK) {
+               break;
+          }
+
+          if (zs.avail_out == 0) {
+               uint8_t *b;
+
+               if (cap > GB_CART_MAX_SIZE) {
+                    break;
+               }
+
+               cap *= 2;
+               if (cap > GB_CART_MAX_SIZE + 1) {
+                    cap = GB_CART_MAX_SIZE + 1;
+               }
+
+               b = realloc(buf, cap);
+               if (b == NULL) {
+                    perror("Can't allocate ROM buffer");
+                    inflateEnd(&zs);
+                    free(buf);
+                    return -1;
+               }
+               buf = b;
+          }
+     }
+
+     if (ret != Z_STREAM_END && zs.total_out <= GB_CART_MAX_SIZE) {
+          fprintf(stderr, "Can't decompress ROM: %s\n",
+                  zs.msg ? zs.msg : "truncated or corrupt data");
+          inflateEnd(&zs);
+          free(buf);
+          return -1;
+     }
+
+     rom->data = buf;
+     rom->length = zs.total_out;
+     rom->mapped = false;
+
+     inflateEnd(&zs);
+
+     return 0;
+}
+
+static uint16_t gb_cart_le16(const uint8_t *p) {
+     return p[0] | (p[1] << 8);
+}
+
+static uint32_t gb_cart_le32(const uint8_t *p) {
+     return gb_cart_le16(p) | ((uint32_t)gb_cart_le16(p + 2) << 16);
+}
+
+/* Returns true if the file name looks like a Game Boy ROM */
+static bool gb_cart_is_rom_name(const uint8_t *name, unsigned len) {
+     static const char * const exts[] = { ".gb", ".gbc", ".cgb" };
+     unsigned i;
+
+     for (i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+          unsigned l = strlen(exts[i]);
+
+          if (len >= l && strncasecmp((const char *)name + len - l,
+                                      exts[i], l) == 0) {
+               return true;
+          }
+     }
+
+     return false;
+}
+
+/* Extract the ROM from a ZIP archive: we use the first file with a ROM
+ * extension, or the first file if there's none. Returns 0 on success, -1 on
+ * error. */
+static int gb_cart_rom_unzip(struct gb_cart_rom *rom,
+                             const uint8_t *data, size_t len) {
+     const uint8_t *eocd = NULL;
+     const uint8_t *entry = NULL;
+     const uint8_t *p;
+     const uint8_t *local;
+     unsigned entries;
+     size_t cd_off;
+     unsigned method;
+     uint32_t csize;
+     uint32_t usize;
+     size_t off;
+     unsigned i;
+
+     /* Look for the end of central directory record, which is followed by a
+      * comment of up to 64KiB */
+     if (len >= 22) {
+          for (off = len - 22; ; off--) {
+               if (gb_cart_le32(data + off) == 0x06054b50) {
+                    eocd = data + off;
+                    break;
+               }
+               if (off == 0 || len - 22 - off >= 0xffff) {
+                    break;
+               }
+          }
+     }
+
+     if (eocd == NULL) {
+          fprintf(stderr, "Invalid ZIP archive\n");
+          return -1;
+     }
+
+     entries = gb_cart_le16(eocd + 10);
+     cd_off = gb_cart_le32(eocd + 16);
+
+     /* The offsets come from the file, they're checked against the length
+      * before we form any pointer from them */
+     for (i = 0; i < entries; i++) {
+          unsigned name_len;
+
+          if (cd_off > len || len - cd_off < 46 ||
+              gb_cart_le32(data + cd_off) != 0x02014b50) {
+               fprintf(stderr, "Invalid ZIP central directory\n");
+               return -1;
+          }
+
+          p = data + cd_off;
+          name_len = gb_cart_le16(p + 28);
+          if (len - cd_off - 46 < name_len) {
+               fprintf(stderr, "Invalid ZIP central directory\n");
+               return -1;
+          }
+
+          if (entry == NULL) {
+               entry = p;
+          }
+
+          if (gb_cart_is_rom_name(p + 46, name_len)) {
+               entry = p;
+               break;
+          }
+
+          cd_off += 46 + (size_t)name_len + gb_cart_le16(p + 30) +
+               gb_cart_le16(p + 32);
+     }
+
+     if (entry == NULL) {
+          fprintf(stderr, "Empty ZIP archive\n");
+          return -1;
+     }
+
+     /* The sizes in the local header may be missing, use the ones from the
+      * central directory */
+     method = gb_cart_le16(entry + 10);
+     csize = gb_cart_le32(entry + 20);
+     usize = gb_cart_le32(entry + 24);
+     off = gb_cart_le32(entry + 42);
+
+     if (off > len || len - off < 30 ||
+         gb_cart_le32(data + off) != 0x04034b50) {
+          fprintf(stderr, "Invalid ZIP local header\n");
+          return -1;
+     }
+
+     local = data + off;
+
+     off += 30 + gb_cart_le16(local + 26) + gb_cart_le16(local + 28);
+     if (off > len || csize > len - off) {
+          fprintf(stderr, "Truncated ZIP archive\n");
+          return -1;
+     }
+
+     switch (method) {
+     case 0:
+          /* Stored */
+          rom->data = malloc(csize ? csize : 1);
+          if (rom->data == NULL) {
+               perror("Can't allocate ROM buffer");
+               return -1;
+          }
+          memcpy(rom->data, data + off, csize);
+          rom->length = csize;
+          rom->mapped = false;
+          return 0;
+     case 8:
+          /* Raw deflate stream */
+          return gb_cart_rom_inflate(rom, data + off, csize, -MAX_WBITS,
+                                     usize);
+     default:
+          fprintf(stderr, "Unsupported ZIP compression method %u\n", method);
+          return -1;
+     }
+}
+
+/* Decode the ROM image in `data`: gzip files and ZIP archives are
+ * decompressed, anything else is copied as-is. The result is stored in a newly
+ * allocated `rom->data`. Returns 0 on success, -1 on error. */
+static int gb_cart_rom_decode(struct gb_cart_rom *rom,
+                              const uint8_t *data, size_t len) {
+     if (len >= 18 && data[0] == 0x1f && data[1] == 0x8b) {
+          /* gzip, the uncompressed size (modulo 2^32) is stored at the
+           * end */
+          return gb_cart_rom_inflate(rom, data, len, 16 + MAX_WBITS,
+                                     gb_cart_le32(data + len - 4));
+     }
+
+     if (len >= 4 && gb_cart_le32(data) == 0x04034b50) {
+          return gb_cart_rom_unzip(rom, data, len);
+     }
+
+     rom->data = malloc(len ? len : 1);
+     if (rom->data == NULL) {
+          perror("Can't allocate ROM buffer");
+          return -1;
+     }
+
+     memcpy(rom->data, data, len);
+     rom->length = len;
+     rom->mapped = false;
+
+     return 0;
+}
+
+/* If the ROM we just loaded is compressed, replace it with its decompressed
+ * version. Returns 0 on success, -1 on error. */
+static int gb_cart_rom_uncompress(struct gb_cart_rom *rom) {
+     uint8_t *file = rom->data;
+     size_t file_length = rom->length;
+     bool file_mapped = rom->mapped;
+     int ret;
+
+     if (file_length < 4 ||
+         !((file[0] == 0x1f && file[1] == 0x8b) ||
+           gb_cart_le32(file) == 0x04034b50)) {
+          return 0;
+     }
+
+     /* `rom->data` is only replaced on success */
+     rom->data = NULL;
+     ret = gb_cart_rom_decode(rom, file, file_length);
+
+     if (file_mapped) {
+          munmap(file, file_length);
+     } else {
+          free(file);
+     }
+
+     return ret;
+}
 
+static void gb_cart_init(struct gb_cart *cart) {
+     cart->image = NULL;
      cart->rom = NULL;
+     cart->rom_length = 0;
      cart->cur_rom_bank = 1;
      cart->ram = NULL;
      cart->cur_ram_bank = 0;
      cart->ram_write_protected = true;
      cart->mbc1_bank_ram = false;
      cart->save_file = NULL;
+     cart->save_map = NULL;
      cart->dirty_ram = false;
      cart->has_rtc = false;
-     has_battery_backup = false;
-
-     if (f == NULL) {
-          perror("Can't open ROM file");
-          goto error;
-     }
-
-     if (fseek(f, 0, SEEK_END) == -1 ||
-         (l = ftell(f)) == -1 ||
-         fseek(f, 0, SEEK_SET) == -1) {
-          fclose(f);
-          perror("Can't get ROM file length");
-          goto error;
-     }
+}
 
-     if (l == 0) {
+/* Parse the header of `rom`. Returns 0 on success, -1 if the ROM is invalid or
+ * unsupported. */
+static int gb_cart_rom_parse(struct gb_cart_rom *rom) {
+     if (rom->length == 0) {
           fprintf(stderr, "ROM file is empty!\n");
-          goto error;
+          return -1;
      }
 
-     if (l > GB_CART_MAX_SIZE) {
+     if (rom->length > GB_CART_MAX_SIZE) {
           fprintf(stderr, "ROM file is too big!\n");
-          goto error;
+          return -1;
      }
 
-     if (l < GB_CART_MIN_SIZE) {
+     if (rom->length < GB_CART_MIN_SIZE) {
           fprintf(stderr, "ROM file is too small!\n");
-          goto error;
-     }
-
-     cart->rom_length = l;
-     cart->rom = calloc(1, cart->rom_length);
-     if (cart->rom == NULL) {
-          perror("Can't allocate ROM buffer");
-          goto error;
-     }
-
-     nread = fread(cart->rom, 1, cart->rom_length, f);
-     if (nread < cart->rom_length) {
-          fprintf(stderr,
-                  "Failed to load ROM file (read %u bytes, expected %u)\n",
-                  (unsigned)nread, cart->rom_length);
-          goto error;
+          return -1;
      }
 
      /* Figure out the number of ROM banks for this cartridge */
-     switch (cart->rom[GB_CART_OFF_ROM_BANKS]) {
+     switch (rom->data[GB_CART_OFF_ROM_BANKS]) {
      case 0:
-          cart->rom_banks = 2;
+          rom->rom_banks = 2;
           break;
      case 1:
-          cart->rom_banks = 4;
+          rom->rom_banks = 4;
           break;
      case 2:
-          cart->rom_banks = 8;
+          rom->rom_banks = 8;
           break;
      case 3:
-          cart->rom_banks = 16;
+          rom->rom_banks = 16;
           break;
      case 4:
-          cart->rom_banks = 32;
+          rom->rom_banks = 32;
           break;
      case 5:
-          cart->rom_banks = 64;
+          rom->rom_banks = 64;
           break;
      case 6:
-          cart->rom_banks = 128;
+          rom->rom_banks = 128;
           break;
      case 7:
-          cart->rom_banks = 256;
+          rom->rom_banks = 256;
           break;
      case 8:
-          cart->rom_banks = 512;
+          rom->rom_banks = 512;
           break;
      case 0x52:
-          cart->rom_banks = 72;
+          rom->rom_banks = 72;
           break;
      case 0x53:
-          cart->rom_banks = 80;
+          rom->rom_banks = 80;
           break;
      case 0x54:
-          cart->rom_banks = 96;
+          rom->rom_banks = 96;
           break;
      default:
           fprintf(stderr, "Unknown ROM size configuration: %x\n",
-                  cart->rom[GB_CART_OFF_ROM_BANKS]);
-          goto error;
+                  rom->data[GB_CART_OFF_ROM_BANKS]);
+          return -1;
      }
 
      /* Make sure the ROM file size is coherent with the declared number of ROM
       * banks */
-     if (cart->rom_length < cart->rom_banks * GB_ROM_BANK_SIZE) {
+     if (rom->length < rom->rom_banks * GB_ROM_BANK_SIZE) {
           fprintf(stderr, "ROM file is too small to hold the declared"
-                  " %d ROM banks\n", cart->rom_banks);
-          goto error;
+                  " %d ROM banks\n", rom->rom_banks);
+          return -1;
      }
 
      /* Figure out the number of RAM banks for this cartridge */
-     switch (cart->rom[GB_CART_OFF_RAM_BANKS]) {
+     switch (rom->data[GB_CART_OFF_RAM_BANKS]) {
      case 0: /* No RAM */
-          cart->ram_banks = 0;
-          cart->ram_length = 0;
+          rom->ram_banks = 0;
+          rom->ram_length = 0;
           break;
      case 1:
           /* One bank but only 2kB (so really 1/4 of a bank) */
-          cart->ram_banks = 1;
-          cart->ram_length = GB_RAM_BANK_SIZE / 4;
+          rom->ram_banks = 1;
+          rom->ram_length = GB_RAM_BANK_SIZE / 4;
           break;
      case 2:
-          cart->ram_banks = 1;
-          cart->ram_length = GB_RAM_BANK_SIZE;
+          rom->ram_banks = 1;
+          rom->ram_length = GB_RAM_BANK_SIZE;
           break;
      case 3:
-          cart->ram_banks = 4;
-          cart->ram_length = GB_RAM_BANK_SIZE * 4;
+          rom->ram_banks = 4;
+          rom->ram_length = GB_RAM_BANK_SIZE * 4;
           break;
      case 4:
-          cart->ram_banks = 16;
-          cart->ram_length = GB_RAM_BANK_SIZE * 16;
+          rom->ram_banks = 16;
+          rom->ram_length = GB_RAM_BANK_SIZE * 16;
           break;
      default:
           fprintf(stderr, "Unknown RAM size configuration: %x\n",
-                  cart->rom[GB_CART_OFF_RAM_BANKS]);
-          goto error;
+                  rom->data[GB_CART_OFF_RAM_BANKS]);
+          return -1;
      }
 
-     switch (cart->rom[GB_CART_OFF_TYPE]) {
+     switch (rom->data[GB_CART_OFF_TYPE]) {
      case 0x00:
-          cart->model = GB_CART_SIMPLE;
+          rom->model = GB_CART_SIMPLE;
           break;
      case 0x01: /* MBC1, no RAM */
      case 0x02: /* MBC1, with RAM */
      case 0x03: /* MBC1, with RAM and battery backup */
-          cart->model = GB_CART_MBC1;
+          rom->model = GB_CART_MBC1;
           break;
      case 0x05: /* MBC2 */
      case 0x06: /* MBC2 with battery backup */
-          cart->model = GB_CART_MBC2;
+          rom->model = GB_CART_MBC2;
           /* MBC2 always has 512 * 4bits of RAM available */
-          cart->ram_banks = 1;
+          rom->ram_banks = 1;
           /* Allocate 512 bytes for convenience, but only the low 4 bits should
            * be used */
-          cart->ram_length = 512;
+          rom->ram_length = 512;
           break;
      case 0x0f: /* MBC3, with battery backup and RTC */
      case 0x10: /* MBC3, with RAM, battery backup and RTC */
      case 0x11: /* MBC3, no RAM */
      case 0x12: /* MBC3, with RAM */
      case 0x13: /* MBC3, with RAM and battery backup */
-          cart->model = GB_CART_MBC3;
+          rom->model = GB_CART_MBC3;
           break;
      case 0x19: /* MBC5, no RAM */
      case 0x1a: /* MBC5, with RAM */
      case 0x1b: /* MBC5, with RAM and battery backup */
-          cart->model = GB_CART_MBC5;
+          rom->model = GB_CART_MBC5;
           break;
      default:
           fprintf(stderr, "Unsupported cartridge type %x\n",
-                  cart->rom[GB_CART_OFF_TYPE]);
-          goto error;
+                  rom->data[GB_CART_OFF_TYPE]);
+          return -1;
      }
 
      /* Check if cart has a battery for memory backup */
-     switch (cart->rom[GB_CART_OFF_TYPE]) {
+     switch (rom->data[GB_CART_OFF_TYPE]) {
      case 0x03:
      case 0x06:
      case 0x09:
@@ -236,16 +740,125 @@ void gb_cart_load(struct gb *gb, const char *rom_path) {
      case 0x1b:
      case 0x1e:
      case 0xff:
-          has_battery_backup = true;
+          rom->has_battery = true;
      }
 
      /* Check if cart has an RTC */
-     switch (cart->rom[GB_CART_OFF_TYPE]) {
+     switch (rom->data[GB_CART_OFF_TYPE]) {
      case 0xf:
      case 0x10:
-          cart->has_rtc = true;
+          rom->has_rtc = true;
+     }
+
+     if (rom->ram_length == 0 && !rom->has_rtc) {
+          /* Memory backup without RAM or RTC doesn't make a lot of sense */
+          rom->has_battery = false;
+     }
+
+     /* See if we have a DMG or GBC game */
+     rom->gbc = (rom->data[GB_CART_OFF_GBC] & 0x80);
+
+     gb_cart_get_rom_title(rom, rom->title);
+
+     return 0;
+}
+
+/* Look up the image with the same contents as `rom` in the cache, or add `rom`
+ * to it if there's none. `rom` is consumed either way. Returns NULL if the ROM
+ * is invalid. */
+static struct gb_cart_rom *gb_cart_rom_cache_get(struct gb_cart_rom *rom) {
+     struct gb_cart_rom *image;
+     uint32_t crc = gb_crc32c(0, rom->data, rom->length);
+
+     pthread_mutex_lock(&gb_cart_rom_cache_lock);
+
+     for (image = gb_cart_rom_cache; image != NULL; image = image->next) {
+          if (image->crc == crc && image->length == rom->length &&
+              memcmp(image->data, rom->data, rom->length) == 0) {
+               image->refcount++;
+               pthread_mutex_unlock(&gb_cart_rom_cache_lock);
+               gb_cart_rom_free(rom);
+               return image;
+          }
+     }
+
+     /* First instance using this ROM */
+     image = malloc(sizeof(*image));
+     if (image == NULL) {
+          perror("malloc failed");
+          goto error;
+     }
+
+     *image = *rom;
+     image->crc = crc;
+     image->refcount = 1;
+     image->has_battery = false;
+     image->has_rtc = false;
+
+     if (gb_cart_rom_parse(image) < 0) {
+          free(image);
+          goto error;
+     }
+
+     image->next = gb_cart_rom_cache;
+     gb_cart_rom_cache = image;
+
+     pthread_mutex_unlock(&gb_cart_rom_cache_lock);
+
+     return image;
+
+error:
+     pthread_mutex_unlock(&gb_cart_rom_cache_lock);
+     gb_cart_rom_free(rom);
+     return NULL;
+}
+
+/* Release a reference to `image`, it's freed when the last cart using it is
+ * unloaded */
+static void gb_cart_rom_cache_put(struct gb_cart_rom *image) {
+     struct gb_cart_rom **p;
+
+     pthread_mutex_lock(&gb_cart_rom_cache_lock);
+
+     if (--image->refcount > 0) {
+          pthread_mutex_unlock(&gb_cart_rom_cache_lock);
+          return;
      }
 
+     for (p = &gb_cart_rom_cache; *p != image; p = &(*p)->next) {
+          ;
+     }
+     *p = image->next;
+
+     pthread_mutex_unlock(&gb_cart_rom_cache_lock);
+
+     gb_cart_rom_free(image);
+     free(image);
+}
+
+/* Set up the cartridge for the ROM `rom`, which is consumed. `name` is only
+ * used for messages. If `save_path` is not NULL and the cartridge has a
+ * battery the RAM and RTC are loaded from and saved to this file. */
+static void gb_cart_setup(struct gb *gb, struct gb_cart_rom *rom,
+                          const char *name,
+                          const char *save_path, bool map_save) {
+     struct gb_cart *cart = &gb->cart;
+     struct gb_cart_rom *image;
+
+     image = gb_cart_rom_cache_get(rom);
+     if (image == NULL) {
+          die();
+     }
+
+     cart->image = image;
+     cart->rom = image->data;
+     cart->rom_length = image->length;
+     cart->rom_banks = image->rom_banks;
+     cart->ram_banks = image->ram_banks;
+     cart->ram_length = image->ram_length;
+     cart->model = image->model;
+     cart->has_rtc = image->has_rtc;
+
      /* Allocate RAM buffer */
      if (cart->ram_length > 0) {
           cart->ram = calloc(1, cart->ram_length);
@@ -253,79 +866,68 @@ void gb_cart_load(struct gb *gb, const char *rom_path) {
                perror("Can't allocate RAM buffer");
                goto error;
           }
-     } else if (!cart->has_rtc) {
-          /* Memory backup without RAM or RTC doesn't make a lot of sense */
-          has_battery_backup = false;
      }
 
-     if (has_battery_backup) {
-          /* Attempt to load save file. We assume that the save file is the name
-           * of the rom with the extension changed to '.sav'. If no extension is
-           * found we simply append '.sav' to the ROM filename */
-          const size_t path_len = strlen(rom_path);
-          FILE *f;
-          size_t pos;
+     /* Start the RTC from the current time of its clock, unless the save
+      * file below overrides it */
+     if (cart->has_rtc) {
+          gb_rtc_init(gb);
+     }
+     cart->rtc_save_crc = 0;
+
+     if (image->has_battery && save_path != NULL) {
+          struct gb_save_layout layout;
+          enum gb_save_status status;
+          uint8_t rtc[GB_RTC_DUMP_SIZE];
+          bool rtc_loaded;
 
-          cart->save_file = malloc(path_len + strlen(".sav"));
+          cart->save_file = strdup(save_path);
           if (cart->save_file == NULL) {
                perror("malloc failed");
                goto error;
           }
 
-          strcpy(cart->save_file, rom_path);
+          gb_cart_save_layout(gb, &layout);
 
-          /* Scan for extension */
-          for (pos = path_len - 1; pos > 0; pos--) {
-               if (cart->save_file[pos] == '.') {
-                    /* Found the extension, truncate it */
-                    cart->save_file[pos] = '\0';
-                    break;
-               }
+          /* The save is validated before anything is loaded, we refuse to
+           * start rather than run (and later overwrite the save) with a
+           * corrupt state */
+          status = gb_save_read(cart->save_file, &layout, cart->ram, rtc,
+                                &rtc_loaded);
+          if (status == GB_SAVE_INVALID) {
+               fprintf(stderr, "Move '%s' away to start without it\n",
+                       cart->save_file);
+               goto error;
           }
 
-          strcat(cart->save_file, ".sav");
+          if (rtc_loaded) {
+               gb_rtc_load(gb, rtc);
+               cart->rtc_save_crc = gb_crc32c(0, rtc, sizeof(rtc));
+          }
 
-          /* First we attempt to load the save file if it already exists */
-          f = fopen(cart->save_file, "rb");
-          if (f != NULL) {
-               /* The file exists, load RAM contents */
-               if (cart->ram_length > 0) {
-                    nread = fread(cart->ram, 1, cart->ram_length, f);
-               } else {
-                    nread = 0;
-               }
+          if (status == GB_SAVE_CONTAINER) {
+               printf("Loaded RAM save from '%s'\n", cart->save_file);
+          } else if (status == GB_SAVE_RAW) {
+               printf("Imported raw RAM save from '%s'\n", cart->save_file);
+          }
 
-               if (nread != cart->ram_length) {
-                    fprintf(stderr, "RAM save file is too small!\n");
-                    fclose(f);
+          if (map_save) {
+               if (gb_cart_map_save(gb, &layout, status) < 0) {
                     goto error;
                }
-
-               if (cart->has_rtc) {
-                    gb_rtc_load(gb, f);
-               }
-
-               fclose(f);
-               printf("Loaded RAM save from '%s'\n", cart->save_file);
-          } else {
-               /* No save file */
-               if (cart->has_rtc) {
-                    gb_rtc_init(gb);
-               }
+               goto save_done;
           }
 
+          gb_save_writer_start(&cart->saver, cart->save_file, &layout);
      }
 
-     /* Success */
-     fclose(f);
-
-     /* See if we have a DMG or GBC game */
-     gb->gbc = (cart->rom[GB_CART_OFF_GBC] & 0x80);
+save_done:
 
-     gb_cart_get_rom_title(gb, rom_title);
+     /* Success */
+     gb->gbc = image->gbc;
 
-     printf("Succesfully Loaded %s\n", rom_path);
-     printf("Title: '%s'\n", rom_title);
+     printf("Succesfully Loaded %s\n", name);
+     printf("Title: '%s'\n", image->title);
      printf("ROM banks: %u (%uKiB)\n", cart->rom_banks,
             cart->rom_banks * GB_ROM_BANK_SIZE / 1024);
      printf("RAM banks: %u (%uKiB)\n", cart->ram_banks,
@@ -333,10 +935,7 @@ void gb_cart_load(struct gb *gb, const char *rom_path) {
      return;
 
 error:
-     if (cart->rom) {
-          free(cart->rom);
-          cart->rom = NULL;
-     }
+     gb_cart_rom_cache_put(image);
 
      if (cart->ram) {
           free(cart->ram);
@@ -347,16 +946,101 @@ error:
           free(cart->save_file);
      }
 
-     if (f) {
-          fclose(f);
+     die();
+}
+
+/* Load the ROM from the file at `rom_path`. gzip files and ZIP archives are
+ * decompressed on the fly. See `gb_cart_setup` for `save_path`. */
+void gb_cart_load(struct gb *gb, const char *rom_path,
+                  const char *save_path, bool map_save) {
+     struct gb_cart_rom rom = { 0 };
+     int fd;
+
+     gb_cart_init(&gb->cart);
+
+     fd = open(rom_path, O_RDONLY);
+     if (fd < 0) {
+          perror("Can't open ROM file");
+          die();
+     }
+
+     if (gb_cart_rom_load_fd(&rom, fd) < 0) {
+          close(fd);
+          die();
      }
 
-     die();
+     close(fd);
+
+     if (gb_cart_rom_uncompress(&rom) < 0) {
+          die();
+     }
+
+     gb_cart_setup(gb, &rom, rom_path, save_path, map_save);
+}
+
+/* Load the ROM from `len` bytes at `data`, which can be freed as soon as this
+ * function returns. gzip and ZIP compressed data is decompressed. See
+ * `gb_cart_setup` for `save_path`. */
+void gb_cart_load_buffer(struct gb *gb, const void *data, size_t len,
+                         const char *save_path, bool map_save) {
+     struct gb_cart_rom rom = { 0 };
+
+     gb_cart_init(&gb->cart);
+
+     if (gb_cart_rom_decode(&rom, data, len) < 0) {
+          die();
+     }
+
+     gb_cart_setup(gb, &rom, "ROM from memory", save_path, map_save);
 }
 
+/* Returns the default save file for the ROM at `rom_path`: the same path with
+ * the extension changed to '.sav' (the compression extension is also removed
+ * for compressed ROMs). If there's no extension we simply append '.sav'. The
+ * returned string must be freed by the caller. */
+char *gb_cart_default_save_file(const char *rom_path) {
+     const size_t path_len = strlen(rom_path);
+     char *save_file;
+     size_t pos;
+     char *ext;
+
+     save_file = malloc(path_len + strlen(".sav") + 1);
+     if (save_file == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     strcpy(save_file, rom_path);
+
+     ext = strrchr(save_file, '.');
+     if (ext && strchr(ext, '/') == NULL &&
+         (strcasecmp(ext, ".gz") == 0 || strcasecmp(ext, ".zip") == 0)) {
+          /* Remove the compression extension */
+          *ext = '\0';
+     }
+
+     /* Scan for extension */
+     for (pos = strlen(save_file); pos > 0; pos--) {
+          if (save_file[pos - 1] == '/') {
+               break;
+          }
+          if (save_file[pos - 1] == '.') {
+               /* Found the extension, truncate it */
+               save_file[pos - 1] = '\0';
+               break;
+          }
+     }
+
+     strcat(save_file, ".sav");
+
+     return save_file;
+}
+
+/* Snapshot the RAM and RTC state and hand it over to the save writer, or
+ * flush the dirty pages if the save file is mapped */
 static void gb_cart_ram_save(struct gb *gb) {
      struct gb_cart *cart = &gb->cart;
-     FILE *f;
+     uint8_t rtc[GB_RTC_DUMP_SIZE];
 
      if (cart->save_file == NULL) {
           /* No battery backup, nothing to do */
@@ -368,30 +1052,18 @@ static void gb_cart_ram_save(struct gb *gb) {
           return;
      }
 
-     f = fopen(cart->save_file, "wb");
-     if (f == NULL) {
-          fprintf(stderr, "Can't create or open save file '%s': %s",
-                  cart->save_file, strerror(errno));
-          die();
-     }
-
-     if (cart->ram_length > 0) {
-          /* Dump RAM to file */
-          if (fwrite(cart->ram, 1, cart->ram_length, f) < 0) {
-               perror("fwrite failed");
-               fclose(f);
-               die();
-          }
+     if (cart->save_map) {
+          gb_cart_flush_save_map(gb, MS_ASYNC);
+          cart->dirty_ram = false;
+          return;
      }
 
      if (cart->has_rtc) {
-          gb_rtc_dump(gb, f);
+          gb_rtc_dump(gb, rtc);
      }
 
-     fflush(f);
-     fclose(f);
+     gb_save_writer_queue(&cart->saver, cart->ram, rtc);
 
-     printf("Saved RAM\n");
      cart->dirty_ram = false;
 }
 
@@ -400,14 +1072,31 @@ void gb_cart_unload(struct gb *gb) {
 
      gb_cart_ram_save(gb);
 
+     if (cart->save_map) {
+          /* The CRC is up to date once we're done */
+          gb_save_set_mapped(cart->save_map, false);
+          gb_cart_flush_save_map(gb, MS_SYNC);
+
+          /* Make sure everything is on disk before we leave */
+          if (msync(cart->save_map, cart->save_map_length, MS_SYNC) < 0) {
+               perror("msync failed");
+          }
+          munmap(cart->save_map, cart->save_map_length);
+          cart->save_map = NULL;
+          /* `ram` pointed into the mapping */
+          cart->ram = NULL;
+     } else if (cart->save_file) {
+          /* Wait for the last save to be written */
+          gb_save_writer_stop(&cart->saver);
+     }
+
      if (cart->save_file) {
           free(cart->save_file);
      }
 
-     if (cart->rom) {
-          free(cart->rom);
-          cart->rom = NULL;
-     }
+     gb_cart_rom_cache_put(cart->image);
+     cart->image = NULL;
+     cart->rom = NULL;
 
      if (cart->ram) {
           free(cart->ram);
@@ -699,6 +1388,7 @@ void gb_cart_ram_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
      }
 
      cart->ram[ram_off] = v;
+     cart->dirty_pages |= 1ULL << (ram_off / GB_CART_SAVE_PAGE_SIZE);
 
 write_done:
      if (cart->save_file) {
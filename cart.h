@@ -14,43 +14,99 @@ enum gb_cart_model {
      GB_CART_MBC5,
 };
 
-struct gb_cart {
+/* ROM image and everything derived from its header. Instances running the same
+ * ROM share a single image through a process-wide cache keyed by the contents
+ * of the ROM, it must be considered read-only once it's been added to the
+ * cache. */
+struct gb_cart_rom {
      /* Full ROM contents */
-     uint8_t *rom;
+     uint8_t *data;
+     /* True if `data` is a read-only mapping of the ROM file, false if it's
+      * been allocated */
+     bool mapped;
      /* ROM length in bytes */
-     unsigned rom_length;
+     unsigned length;
+     /* CRC32C of the ROM contents */
+     uint32_t crc;
+     /* Number of carts using this image. Protected by the cache lock */
+     unsigned refcount;
+     /* Type of cartridge */
+     enum gb_cart_model model;
      /* Number of ROM banks (each bank is 16KB) */
      unsigned rom_banks;
-     /* Currently selected ROM bank */
-     unsigned cur_rom_bank;
-     /* Full cartrige ram contents */
-     uint8_t *ram;
-     /* RAM length in bytes */
-     unsigned ram_length;
      /* Number of RAM banks (each bank is 8KB) */
      unsigned ram_banks;
-     /* Currently selected RAM bank*/
-     unsigned cur_ram_bank;
-     /* True if RAM is write-protected (read-only) */
-     bool ram_write_protected;
+     /* RAM length in bytes */
+     unsigned ram_length;
+     /* True if the RAM and/or RTC are battery-backed */
+     bool has_battery;
+     /* True if the cartrige has a Real Time Clock */
+     bool has_rtc;
+     /* True if the game supports the Game Boy Color */
+     bool gbc;
+     /* Printable title from the header */
+     char title[17];
+     /* Next image in the cache */
+     struct gb_cart_rom *next;
+};
+
+/* The fields used by every ROM and RAM access come first */
+struct gb_cart {
+     /* Full ROM contents (`image->data`) */
+     const uint8_t *rom;
+     /* Currently selected ROM bank */
+     unsigned cur_rom_bank;
+     /* Number of ROM banks (each bank is 16KB) */
+     unsigned rom_banks;
      /* Type of cartridge */
      enum gb_cart_model model;
      /* False if the MBC1 cartridge operates in 128 ROM banks/1 RAM bank
       * configuration otherwise it operates in 32 ROM banks/4 RAM banks
       * configuration. */
      bool mbc1_bank_ram;
-     /* If we have a battery backup we save and restore the contents of the RAM
-      * from this file */
-     char *save_file;
+     /* True if RAM is write-protected (read-only) */
+     bool ram_write_protected;
      /* Dirty flag, set to true when the RAM has been written to */
      bool dirty_ram;
      /* True if the cartrige has a Real Time Clock */
      bool has_rtc;
+     /* Full cartrige ram contents */
+     uint8_t *ram;
+     /* Currently selected RAM bank*/
+     unsigned cur_ram_bank;
+     /* Number of RAM banks (each bank is 8KB) */
+     unsigned ram_banks;
+     /* RAM length in bytes */
+     unsigned ram_length;
+     /* ROM length in bytes */
+     unsigned rom_length;
+     /* Shared ROM image */
+     struct gb_cart_rom *image;
+     /* If we have a battery backup we save and restore the contents of the RAM
+      * from this file */
+     char *save_file;
+     /* Background writer for `save_file` */
+     struct gb_save_writer saver;
+     /* If not NULL the save file is mapped here and `ram` points to its RAM
+      * block */
+     uint8_t *save_map;
+     /* Length of `save_map` in bytes */
+     size_t save_map_length;
+     /* One bit per GB_CART_SAVE_PAGE_SIZE page of `ram` modified since the
+      * last flush of `save_map` */
+     uint64_t dirty_pages;
      /* RTC state (if the cart has one) */
      struct gb_rtc rtc;
+     /* CRC32C of the RTC state loaded from the save file, 0 if the RTC
+      * started from the current time of its clock */
+     uint32_t rtc_save_crc;
 };
 
-void gb_cart_load(struct gb *gb, const char *rom_path);
+void gb_cart_load(struct gb *gb, const char *rom_path,
+                  const char *save_path, bool map_save);
+void gb_cart_load_buffer(struct gb *gb, const void *data, size_t len,
+                         const char *save_path, bool map_save);
+char *gb_cart_default_save_file(const char *rom_path);
 void gb_cart_unload(struct gb *gb);
 void gb_cart_sync(struct gb *gb);
 uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr);
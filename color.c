@@ -0,0 +1,96 @@
+#include "gb.h"
+
+uint32_t gb_color_lut_xrgb8888[GB_COLOR_GBC_COUNT];
+uint16_t gb_color_lut_rgb565[GB_COLOR_GBC_COUNT];
+bool gb_color_corrected;
+
+/* We use shades of green to look like the original DMG LCD */
+const uint32_t gb_color_dmg_xrgb8888[4] = {
+     [GB_COL_WHITE]     = 0xff75a32c,
+     [GB_COL_LIGHTGREY] = 0xff387a21,
+     [GB_COL_DARKGREY]  = 0xff255116,
+     [GB_COL_BLACK]     = 0xff12280b,
+};
+
+static uint32_t gb_color_5_to_8bits(uint32_t v) {
+     return (v << 3) | (v >> 2);
+}
+
+uint16_t gb_color_xrgb8888_to_rgb565(uint32_t c) {
+     uint16_t r = (c >> 16) & 0xff;
+     uint16_t g = (c >> 8) & 0xff;
+     uint16_t b = c & 0xff;
+
+     return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+/* Straight conversion: each 5bit component is extended to 8 bits */
+static uint32_t gb_color_convert_raw(uint16_t c) {
+     uint32_t r = c & 0x1f;
+     uint32_t g = (c >> 5) & 0x1f;
+     uint32_t b = (c >> 10) & 0x1f;
+     uint32_t p;
+
+     /* Extend from 5 to 8 bits */
+     r = gb_color_5_to_8bits(r);
+     g = gb_color_5_to_8bits(g);
+     b = gb_color_5_to_8bits(b);
+
+     p = 0xff000000;
+     p |= r << 16;
+     p |= g << 8;
+     p |= b;
+
+     return p;
+}
+
+/* Approximate the way colors look on the GBC's LCD: the components bleed into
+ * each other and the screen never gets completely white, which makes raw
+ * colors look oversaturated on a modern display. The coefficients come from
+ * the color emulation used by byuu's higan. */
+static uint32_t gb_color_convert_corrected(uint16_t c) {
+     uint32_t r = c & 0x1f;
+     uint32_t g = (c >> 5) & 0x1f;
+     uint32_t b = (c >> 10) & 0x1f;
+     uint32_t cr;
+     uint32_t cg;
+     uint32_t cb;
+     uint32_t p;
+
+     cr = r * 26 + g * 4 + b * 2;
+     cg = g * 24 + b * 8;
+     cb = r * 6 + g * 4 + b * 22;
+
+     /* Saturate and scale to 8 bits */
+     cr = (cr > 960 ? 960 : cr) >> 2;
+     cg = (cg > 960 ? 960 : cg) >> 2;
+     cb = (cb > 960 ? 960 : cb) >> 2;
+
+     p = 0xff000000;
+     p |= cr << 16;
+     p |= cg << 8;
+     p |= cb;
+
+     return p;
+}
+
+/* Build the conversion tables. Must be called before any GBC frame is
+ * rendered. */
+void gb_color_init(bool color_correction) {
+     unsigned c;
+
+     gb_color_corrected = color_correction;
+
+     for (c = 0; c < GB_COLOR_GBC_COUNT; c++) {
+          uint32_t p;
+
+          if (color_correction) {
+               p = gb_color_convert_corrected(c);
+          } else {
+               p = gb_color_convert_raw(c);
+          }
+
+          gb_color_lut_xrgb8888[c] = p;
+          gb_color_lut_rgb565[c] = gb_color_xrgb8888_to_rgb565(p);
+     }
+}
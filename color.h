@@ -0,0 +1,31 @@
+#ifndef _GB_COLOR_H_
+#define _GB_COLOR_H_
+
+/* Number of colors representable in the GBC's 15bit BGR 555 format */
+#define GB_COLOR_GBC_COUNT 0x8000
+
+/* Lookup tables converting GBC colors to the frontend pixel formats. Built by
+ * gb_color_init. */
+extern uint32_t gb_color_lut_xrgb8888[GB_COLOR_GBC_COUNT];
+extern uint16_t gb_color_lut_rgb565[GB_COLOR_GBC_COUNT];
+
+/* DMG shades in xRGB 8888 */
+extern const uint32_t gb_color_dmg_xrgb8888[4];
+
+/* True if the GBC tables have been built with color correction */
+extern bool gb_color_corrected;
+
+void gb_color_init(bool color_correction);
+uint16_t gb_color_xrgb8888_to_rgb565(uint32_t c);
+
+/* Convert a GBC BGR 555 color to xRGB 8888 */
+static inline uint32_t gb_color_gbc_to_xrgb8888(uint16_t c) {
+     return gb_color_lut_xrgb8888[c & 0x7fff];
+}
+
+/* Convert a GBC BGR 555 color to RGB 565 */
+static inline uint16_t gb_color_gbc_to_rgb565(uint16_t c) {
+     return gb_color_lut_rgb565[c & 0x7fff];
+}
+
+#endif /* _GB_COLOR_H_ */
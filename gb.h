@@ -5,7 +5,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 struct gb;
 
@@ -14,57 +18,105 @@ struct gb;
 #include "cpu.h"
 #include "memory.h"
 #include "rtc.h"
+#include "save.h"
 #include "cart.h"
 #include "gpu.h"
+#include "color.h"
 #include "input.h"
 #include "dma.h"
 #include "hdma.h"
 #include "timer.h"
+#include "blep.h"
 #include "spu.h"
 #include "frontend.h"
+#include "capture.h"
+#include "hash.h"
+#include "snapshot.h"
 
 /* DMG CPU frequency. Super GameBoy runs slightly faster (4.295454MHz). */
 #define GB_CPU_FREQ_HZ 4194304U
 
+/* Size of a cache line on the CPUs we care about */
+#define GB_CACHE_LINE_SIZE 64
+
+/* The fields are ordered by how often they're accessed: everything used by
+ * every single instruction comes first and fits in one cache line (see the
+ * checks below), followed by the state used by most memory accesses. The
+ * structure must be allocated with `gb_alloc` to get the alignment right. */
 struct gb {
+     /* CPU registers */
+     _Alignas(GB_CACHE_LINE_SIZE) struct gb_cpu cpu;
+
+     /* Counter keeping track of how many CPU cycles have elapsed since an
+      * arbitrary point in time. Used to synchronize the other devices. */
+     int32_t timestamp;
+     struct gb_irq irq;
+     /* True if the GBC is running in double-speed mode */
+     bool double_speed;
      /* True if we're emulating a GBC, false if we're emulating a DMG */
      bool gbc;
-
+     /* Always 1 on DMG, 1-7 on GBC */
+     uint8_t iram_high_bank;
+     /* Always false on DMG */
+     bool    vram_high_bank;
      /* True if a speed switch has been requested. It will take effect when a
       * STOP operation is executed */
      bool speed_switch_pending;
-     /* True if the GBC is running in double-speed mode */
-     bool double_speed;
-
-     /* Counter keeping track of how many CPU cycles have elapsed since an
-      * arbitrary point in time. Used to synchronize the other devices. */
-     int32_t timestamp;
      /* Set by the frontend when the user requested that the emulation stops */
      bool quit;
-
-     struct gb_irq irq;
-     struct gb_frontend frontend;
+     /* Internal RAM: 8KiB on DMG, 32 KiB on GBC (see GB_IRAM_SIZE) */
+     uint8_t *iram;
+     /* Video RAM: 8KiB on DMG, 16KiB on GBC (see GB_VRAM_SIZE) */
+     uint8_t *vram;
+     /* `first_event` is checked after every instruction, the rest is only
+      * used when an event fires */
      struct gb_sync sync;
-     struct gb_cpu cpu;
+
+     /* Mapper state, used by every ROM access */
      struct gb_cart cart;
+     /* Zero-page RAM */
+     uint8_t zram[0x7f];
+
      struct gb_gpu gpu;
      struct gb_input input;
      struct gb_dma dma;
      struct gb_hdma hdma;
      struct gb_timer timer;
      struct gb_spu spu;
-     /* Internal RAM: 8KiB on DMG, 32 KiB on GBC */
-     uint8_t iram[0x8000];
-     /* Always 1 on DMG, 1-7 on GBC */
-     uint8_t iram_high_bank;
-     /* Zero-page RAM */
-     uint8_t zram[0x7f];
-     /* Video RAM: 8KiB on DMG, 16KiB on GBC */
-     uint8_t vram[0x4000];
-     /* Always false on DMG */
-     bool    vram_high_bank;
+     struct gb_frontend frontend;
+     /* Per-frame hash log, or NULL if disabled */
+     struct gb_hash_log *hash_log;
 };
 
+/* Make sure that the per-instruction working set stays within the first cache
+ * line */
+#define GB_HOT_FIELD_END(_f) \
+     (offsetof(struct gb, _f) + sizeof(((struct gb *)0)->_f))
+_Static_assert(GB_HOT_FIELD_END(cpu) <= GB_CACHE_LINE_SIZE,
+               "CPU state outside of the first cache line");
+_Static_assert(GB_HOT_FIELD_END(timestamp) <= GB_CACHE_LINE_SIZE,
+               "timestamp outside of the first cache line");
+_Static_assert(GB_HOT_FIELD_END(irq) <= GB_CACHE_LINE_SIZE,
+               "IRQ state outside of the first cache line");
+_Static_assert(GB_HOT_FIELD_END(vram) <= GB_CACHE_LINE_SIZE,
+               "RAM banking outside of the first cache line");
+_Static_assert(GB_HOT_FIELD_END(sync.first_event) <= GB_CACHE_LINE_SIZE,
+               "first_event outside of the first cache line");
+/* The ROM banking state is used by most instruction fetches */
+_Static_assert(GB_HOT_FIELD_END(cart.rom_banks) <= 2 * GB_CACHE_LINE_SIZE,
+               "ROM banking outside of the second cache line");
+
+/* Allocate a zeroed, properly aligned emulator context */
+static inline struct gb *gb_alloc(void) {
+     struct gb *gb = aligned_alloc(_Alignof(struct gb), sizeof(struct gb));
+
+     if (gb != NULL) {
+          memset(gb, 0, sizeof(*gb));
+     }
+
+     return gb;
+}
+
 static inline void die(void) {
      exit(EXIT_FAILURE);
 }
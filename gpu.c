@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "gb.h"
 
 /* GPU timings:
@@ -39,6 +41,105 @@
 /* Total number of lines (including vertical blanking) */
 #define VTOTAL (VSYNC_START + VSYNC_LINES)
 
+/* Convert a DMG shade to the frame buffer's pixel format */
+static uint32_t gb_gpu_fb_dmg_color(struct gb *gb, enum gb_color shade) {
+     uint32_t c = gb_color_dmg_xrgb8888[shade];
+
+     switch (gb->frontend.fb.format) {
+     case GB_PIXEL_RGB565:
+          return gb_color_xrgb8888_to_rgb565(c);
+     case GB_PIXEL_XRGB8888:
+          return c;
+     default:
+          return shade;
+     }
+}
+
+/* Convert a GBC BGR 555 color to the frame buffer's pixel format */
+static uint32_t gb_gpu_fb_gbc_color(struct gb *gb, uint16_t c) {
+     switch (gb->frontend.fb.format) {
+     case GB_PIXEL_RGB565:
+          return gb_color_gbc_to_rgb565(c);
+     case GB_PIXEL_XRGB8888:
+          return gb_color_gbc_to_xrgb8888(c);
+     default:
+          return 0;
+     }
+}
+
+/* Recompute the whole `fb_palette` */
+void gb_gpu_fb_palette_reload(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+     unsigned i;
+
+     if (!gb->gbc) {
+          for (i = 0; i < 4; i++) {
+               gpu->fb_palette[i] = gb_gpu_fb_dmg_color(gb, i);
+          }
+          return;
+     }
+
+     for (i = 0; i < 32; i++) {
+          uint16_t bg = gpu->bg_palettes.colors[i / 4][i % 4];
+          uint16_t sprite = gpu->sprite_palettes.colors[i / 4][i % 4];
+
+          gpu->fb_palette[i] = gb_gpu_fb_gbc_color(gb, bg);
+          gpu->fb_palette[32 + i] = gb_gpu_fb_gbc_color(gb, sprite);
+     }
+
+     gpu->fb_palette[GB_GPU_GBC_BLANK] = gb_gpu_fb_gbc_color(gb, 0);
+     gpu->fb_palette[GB_GPU_GBC_LCD_OFF] = gb_gpu_fb_gbc_color(gb, 0x7fff);
+}
+
+/* Handle a write to the GBC background (BCPD) or sprite (OCPD) palette data
+ * register */
+void gb_gpu_palette_write(struct gb *gb, bool sprite, uint8_t v) {
+     struct gb_gpu *gpu = &gb->gpu;
+     struct gb_color_palette *p;
+     uint16_t index;
+     unsigned palette;
+     unsigned color_index;
+     bool high;
+     uint16_t col;
+     unsigned fb_index;
+
+     if (sprite) {
+          p = &gpu->sprite_palettes;
+     } else {
+          p = &gpu->bg_palettes;
+     }
+
+     index = p->write_index;
+     palette = index >> 3;
+     color_index = (index >> 1) & 3;
+     high = index & 1;
+
+     col = p->colors[palette][color_index];
+
+     if (high) {
+          col &= 0xff;
+          col |= v << 8;
+     } else {
+          col &= 0xff00;
+          col |= v;
+     }
+
+     p->colors[palette][color_index] = col;
+
+     /* Keep the converted color in sync. Sprite palettes come after the 8
+      * background palettes */
+     fb_index = palette * 4 + color_index;
+     if (sprite) {
+          fb_index += 32;
+     }
+
+     gpu->fb_palette[fb_index] = gb_gpu_fb_gbc_color(gb, col);
+
+     if (p->auto_increment) {
+          p->write_index = (p->write_index + 1) & 0x3f;
+     }
+}
+
 void gb_gpu_reset(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
      unsigned i;
@@ -65,10 +166,14 @@ void gb_gpu_reset(struct gb *gb) {
      gpu->wx = 0;
      gpu->wy = 0;
      gpu->line_pos = 0;
+     gpu->frames = 0;
+     gpu->vram_dirty = true;
 
      for (i = 0; i < sizeof(gpu->oam); i++) {
           gpu->oam[i] = 0;
      }
+
+     gb_gpu_fb_palette_reload(gb);
 }
 
 static uint8_t gb_gpu_get_mode(struct gb *gb) {
@@ -94,14 +199,28 @@ static uint8_t gb_gpu_get_mode(struct gb *gb) {
 }
 
 struct gb_gpu_pixel {
-     union gb_gpu_color color;
+     /* DMG: shade of the pixel. GBC: index in palette RAM (see enum
+      * gb_pixel_format) */
+     uint8_t index;
      bool opaque;
      /* GBC only: true if the background pixel has priority */
      bool priority;
 };
 
+/* Everything the renderer needs to draw a single line. In synchronous mode this
+ * points directly at the live GPU state, in threaded mode it points at the
+ * snapshot taken when the line was queued. */
+struct gb_gpu_line {
+     /* GPU registers, OAM and palettes */
+     const struct gb_gpu *gpu;
+     /* Video RAM contents */
+     const uint8_t *vram;
+     /* True if we're rendering in GBC mode */
+     bool gbc;
+};
+
 /* Get a pixel value from the tileset */
-static enum gb_color gb_gpu_get_tile_color(struct gb *gb,
+static enum gb_color gb_gpu_get_tile_color(const struct gb_gpu_line *line,
                                            uint8_t tile_index,
                                            uint8_t x, uint8_t y,
                                            bool use_sprite_ts,
@@ -135,8 +254,8 @@ static enum gb_color gb_gpu_get_tile_color(struct gb *gb,
      x = 7 - x;
 
      /* The pixel value is two bits split across two contiguous bytes */
-     lsb = (gb->vram[tile_addr + y * 2 + 0] >> x) & 1;
-     msb = (gb->vram[tile_addr + y * 2 + 1] >> x) & 1;
+     lsb = (line->vram[tile_addr + y * 2 + 0] >> x) & 1;
+     msb = (line->vram[tile_addr + y * 2 + 1] >> x) & 1;
 
      return (msb << 1) | lsb;
 }
@@ -148,10 +267,10 @@ static enum gb_color gb_gpu_palette_transform(enum gb_color color,
      return (palette >> off) & 3;
 }
 
-static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(struct gb *gb,
+static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(const struct gb_gpu_line *line,
                                                    uint8_t x, uint8_t y,
                                                    bool use_high_tm) {
-     struct gb_gpu *gpu = &gb->gpu;
+     const struct gb_gpu *gpu = line->gpu;
 
      /* Coordinates of the tile in the tile map (each tile is 8x8 pixels) */
      unsigned tile_map_x = x / 8;
@@ -178,11 +297,11 @@ static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(struct gb *gb,
      tm_addr += tile_map_y * 32 + tile_map_x;
 
      /* Look up the tile map entry in VRAM */
-     tile_index = gb->vram[tm_addr];
+     tile_index = line->vram[tm_addr];
 
-     if (gb->gbc) {
+     if (line->gbc) {
           /* On the GBC we have additional attributes in the 2nd VRAM bank */
-          uint8_t attrs = gb->vram[tm_addr + 0x2000];
+          uint8_t attrs = line->vram[tm_addr + 0x2000];
           bool priority = attrs & 0x80;
           bool y_flip = attrs & 0x40;
           bool x_flip = attrs & 0x20;
@@ -200,46 +319,47 @@ static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(struct gb *gb,
                tile_y = 7 - tile_y;
           }
 
-          col = gb_gpu_get_tile_color(gb, tile_index,
+          col = gb_gpu_get_tile_color(line, tile_index,
                                       tile_x, tile_y,
                                       use_sprite_ts,
                                       high_bank);
 
           pix.opaque = col != GB_COL_WHITE;
 
-          pix.color.gbc_color = gpu->bg_palettes.colors[palette][col];
+          pix.index = palette * 4 + col;
      } else {
+          enum gb_color col;
+
           pix.priority = false;
 
-          pix.color.dmg_color = gb_gpu_get_tile_color(gb, tile_index,
-                                                      tile_x, tile_y,
-                                                      use_sprite_ts,
-                                                      false);
-          pix.opaque = pix.color.dmg_color != GB_COL_WHITE;
+          col = gb_gpu_get_tile_color(line, tile_index,
+                                      tile_x, tile_y,
+                                      use_sprite_ts,
+                                      false);
+          pix.opaque = col != GB_COL_WHITE;
 
-          pix.color.dmg_color = gb_gpu_palette_transform(pix.color.dmg_color,
-                                                         gpu->bgp);
+          pix.index = gb_gpu_palette_transform(col, gpu->bgp);
      }
 
      return pix;
 }
 
-static struct gb_gpu_pixel gb_gpu_get_bg_pixel(struct gb *gb,
+static struct gb_gpu_pixel gb_gpu_get_bg_pixel(const struct gb_gpu_line *line,
                                                unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
+     const struct gb_gpu *gpu = line->gpu;
      uint8_t bgx = (x + gpu->scx) & 0xff;
      uint8_t bgy = (y + gpu->scy) & 0xff;
 
-     return gb_gpu_get_bg_win_pixel(gb, bgx, bgy, gpu->bg_use_high_tm);
+     return gb_gpu_get_bg_win_pixel(line, bgx, bgy, gpu->bg_use_high_tm);
 }
 
-static struct gb_gpu_pixel gb_gpu_get_win_pixel(struct gb *gb,
+static struct gb_gpu_pixel gb_gpu_get_win_pixel(const struct gb_gpu_line *line,
                                                 unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
+     const struct gb_gpu *gpu = line->gpu;
      uint8_t wx = x + 7 - gpu->wx;
      uint8_t wy = y - gpu->wy;
 
-     return gb_gpu_get_bg_win_pixel(gb, wx, wy, gpu->window_use_high_tm);
+     return gb_gpu_get_bg_win_pixel(line, wx, wy, gpu->window_use_high_tm);
 }
 
 struct gb_sprite {
@@ -270,8 +390,9 @@ struct gb_sprite {
      uint8_t palette;
 };
 
-static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
-     struct gb_gpu *gpu = &gb->gpu;
+static struct gb_sprite gb_get_oam_sprite(const struct gb_gpu_line *line,
+                                          unsigned index) {
+     const struct gb_gpu *gpu = line->gpu;
      struct gb_sprite s;
      unsigned oam_off = index * 4;
      uint8_t flags;
@@ -293,7 +414,7 @@ static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
      s.y_flip = flags & 0x40;
      s.background = flags & 0x80;
 
-     if (gb->gbc) {
+     if (line->gbc) {
           s.high_bank = flags & 0x08;
           s.palette = flags & 0x07;
      } else {
@@ -308,11 +429,11 @@ static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
 #define GB_GPU_LINE_SPRITES 10
 
 static void gb_gpu_get_line_sprites(
-     struct gb *gb,
+     const struct gb_gpu_line *line,
      unsigned ly,
      struct gb_sprite sprites[GB_GPU_LINE_SPRITES + 1]) {
 
-     struct gb_gpu *gpu = &gb->gpu;
+     const struct gb_gpu *gpu = line->gpu;
      int i;
      unsigned n_sprites;
      unsigned sprite_height;
@@ -334,7 +455,7 @@ static void gb_gpu_get_line_sprites(
       */
      n_sprites = 0;
      for (i = 0; i < GB_GPU_MAX_SPRITES; i++) {
-          struct gb_sprite s = gb_get_oam_sprite(gb, i);
+          struct gb_sprite s = gb_get_oam_sprite(line, i);
 
           if ((int)ly < s.y || (int)ly >= (s.y + (int)sprite_height)) {
                /* Sprite isn't on this line */
@@ -354,7 +475,7 @@ static void gb_gpu_get_line_sprites(
       */
      sprites[n_sprites].x = GB_LCD_WIDTH * 2;
 
-     if (gb->gbc) {
+     if (line->gbc) {
           /* In GBC mode the sprite priority is not based on X-coordinates but
            * simply on the index in OAM, so we already have the entries in the
            * array in the right order (from highest priority to lowest) */
@@ -386,12 +507,12 @@ static void gb_gpu_get_line_sprites(
 /* Attempt to sample the given sprite at the given location on the screen.
  * Returns false if the sprite is not visible at these coordinates, otherwise it
  * updates `p` with the pixel color and returns true. */
-static bool gb_gpu_get_sprite_col(struct gb *gb,
+static bool gb_gpu_get_sprite_col(const struct gb_gpu_line *line,
                                   const struct gb_sprite *sprite,
                                   unsigned x,
                                   unsigned y,
                                   struct gb_gpu_pixel *p) {
-     struct gb_gpu *gpu = &gb->gpu;
+     const struct gb_gpu *gpu = line->gpu;
      unsigned sprite_x;
      unsigned sprite_y;
      unsigned sprite_flip_height;
@@ -425,7 +546,7 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
           sprite_y = sprite_flip_height - sprite_y;
      }
 
-     col = gb_gpu_get_tile_color(gb, tile_index,
+     col = gb_gpu_get_tile_color(line, tile_index,
                                  sprite_x, sprite_y,
                                  true, sprite->high_bank);
 
@@ -434,9 +555,9 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
           return false;
      }
 
-     if (gb->gbc) {
-          p->color.gbc_color =
-               gpu->sprite_palettes.colors[sprite->palette][col];
+     if (line->gbc) {
+          /* Sprite palettes come after the 8 background palettes */
+          p->index = 32 + sprite->palette * 4 + col;
      } else {
           uint8_t palette;
 
@@ -446,51 +567,82 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
                palette = gpu->obp0;
           }
 
-          p->color.dmg_color = gb_gpu_palette_transform(col, palette);
+          p->index = gb_gpu_palette_transform(col, palette);
      }
 
      return true;
 }
 
 /* Returns true if the given screen coordinates lie within the window */
-static bool gb_gpu_pix_in_window(struct gb *gb, unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
+static bool gb_gpu_pix_in_window(const struct gb_gpu_line *line,
+                                 unsigned x, unsigned y) {
+     const struct gb_gpu *gpu = line->gpu;
      int wx = (int)gpu->wx - 7;
 
      return (int)x >= wx && y >= gpu->wy;
 }
 
-static void gb_gpu_draw_cur_line(struct gb *gb) {
-     struct gb_gpu *gpu = &gb->gpu;
-     union gb_gpu_color line[GB_LCD_WIDTH];
+/* Convert the pixel indexes of line `ly` to the frontend's pixel format and
+ * store them in the frame buffer */
+static void gb_gpu_output_line(struct gb *gb, const struct gb_gpu_line *line,
+                               unsigned ly,
+                               const uint8_t indexes[GB_LCD_WIDTH]) {
+     struct gb_framebuffer *fb = &gb->frontend.fb;
+     uint8_t *out = (uint8_t *)fb->pixels + ly * fb->pitch;
+     const uint32_t *palette = line->gpu->fb_palette;
+     unsigned x;
+
+     if (fb->format == GB_PIXEL_INDEXED8) {
+          memcpy(out, indexes, GB_LCD_WIDTH);
+          return;
+     }
+
+     if (fb->format == GB_PIXEL_RGB565) {
+          uint16_t *out16 = (uint16_t *)out;
+
+          for (x = 0; x < GB_LCD_WIDTH; x++) {
+               out16[x] = palette[indexes[x]];
+          }
+     } else {
+          uint32_t *out32 = (uint32_t *)out;
+
+          for (x = 0; x < GB_LCD_WIDTH; x++) {
+               out32[x] = palette[indexes[x]];
+          }
+     }
+}
+
+static void gb_gpu_render_line(struct gb *gb, const struct gb_gpu_line *line) {
+     const struct gb_gpu *gpu = line->gpu;
+     uint8_t indexes[GB_LCD_WIDTH];
      /* We force a "dummy" out-of-frame sprite at the end to avoid checking for
       * bounds while we draw the line */
      struct gb_sprite line_sprites[GB_GPU_LINE_SPRITES + 1];
      unsigned x;
      unsigned next_sprite = 0;
 
-     gb_gpu_get_line_sprites(gb, gpu->ly, line_sprites);
+     gb_gpu_get_line_sprites(line, gpu->ly, line_sprites);
 
      for (x = 0; x < GB_LCD_WIDTH; x++) {
           struct gb_gpu_pixel p = {
-               .color.dmg_color = GB_COL_WHITE,
+               .index = line->gbc ? GB_GPU_GBC_BLANK : GB_COL_WHITE,
                .opaque = false,
                .priority = false,
           };
           struct gb_sprite s;
           unsigned i;
 
-          if (gpu->window_enable && gb_gpu_pix_in_window(gb, x, gpu->ly)) {
+          if (gpu->window_enable && gb_gpu_pix_in_window(line, x, gpu->ly)) {
                /* Pixel lies within the window */
-               p = gb_gpu_get_win_pixel(gb, x, gpu->ly);
+               p = gb_gpu_get_win_pixel(line, x, gpu->ly);
           } else if (gpu->bg_enable) {
-               p = gb_gpu_get_bg_pixel(gb, x, gpu->ly);
+               p = gb_gpu_get_bg_pixel(line, x, gpu->ly);
           }
 
           /* If the background priority is set it means that the BG has the
            * priority over any sprite at this location */
           if (!p.priority || !p.opaque) {
-               if (gb->gbc) {
+               if (line->gbc) {
                     /* In GBC the sprites aren't ordered by x-coordinate because
                      * the location in OAM has priority, so we have to iterate
                      * through the entire list until we find a visible sprite or
@@ -504,7 +656,7 @@ static void gb_gpu_draw_cur_line(struct gb *gb) {
                               continue;
                          }
 
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
+                         if (gb_gpu_get_sprite_col(line, &s, x, gpu->ly, &p)) {
                               break;
                          }
                     }
@@ -525,20 +677,262 @@ static void gb_gpu_draw_cur_line(struct gb *gb) {
                     for (i = next_sprite; line_sprites[i].x <= (int)x; i++) {
                          s = line_sprites[i];
 
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
+                         if (gb_gpu_get_sprite_col(line, &s, x, gpu->ly, &p)) {
                               break;
                          }
                     }
                }
           }
 
-          line[x] = p.color;
+          indexes[x] = p.index;
      }
 
-     if (gb->gbc) {
-          gb->frontend.draw_line_gbc(gb, gpu->ly, line);
-     } else {
-          gb->frontend.draw_line_dmg(gb, gpu->ly, line);
+     gb_gpu_output_line(gb, line, gpu->ly, indexes);
+}
+
+/* Number of lines that can be queued for the render thread */
+#define GB_GPU_RENDER_QUEUE_LEN 256
+/* Number of VRAM copies that can be in flight between the emulation thread
+ * and the render thread */
+#define GB_GPU_VRAM_SNAPSHOTS 8
+/* Size of a VRAM snapshot slot, large enough for both GBC banks */
+#define GB_GPU_VRAM_SIZE GB_VRAM_SIZE(true)
+
+enum gb_gpu_render_cmd {
+     /* Render the line in `gpu` */
+     GB_GPU_RENDER_LINE,
+     /* Signal `idle` once every previous command has been processed */
+     GB_GPU_RENDER_FLUSH,
+     /* Stop the render thread */
+     GB_GPU_RENDER_QUIT,
+};
+
+struct gb_gpu_render_job {
+     enum gb_gpu_render_cmd cmd;
+     /* Snapshot of the GPU state at the time the line was queued */
+     struct gb_gpu gpu;
+     /* Index of the VRAM snapshot to use to render this line */
+     unsigned vram_snapshot;
+};
+
+struct gb_gpu_renderer {
+     pthread_t thread;
+     /* Single-producer, single-consumer ring of jobs. `head` is only ever
+      * written by the emulation thread and `tail` by the render thread. */
+     struct gb_gpu_render_job queue[GB_GPU_RENDER_QUEUE_LEN];
+     unsigned head;
+     unsigned tail;
+     /* Number of queued jobs. Only used to put the render thread to sleep when
+      * the queue is empty, the data itself is exchanged through the ring. */
+     sem_t ready;
+     /* Number of free entries in the queue */
+     sem_t free;
+     /* Posted by the render thread when it reaches a GB_GPU_RENDER_FLUSH */
+     sem_t idle;
+     /* Copies of VRAM. A new snapshot is only taken when the VRAM has been
+      * modified since the previous line was queued */
+     uint8_t vram[GB_GPU_VRAM_SNAPSHOTS][GB_GPU_VRAM_SIZE];
+     /* Number of queued lines referencing each VRAM snapshot */
+     atomic_uint vram_users[GB_GPU_VRAM_SNAPSHOTS];
+     /* VRAM snapshot used by the lines currently being queued */
+     unsigned cur_vram;
+};
+
+static void *gb_gpu_render_thread(void *arg) {
+     struct gb *gb = arg;
+     struct gb_gpu_renderer *r = gb->gpu.renderer;
+
+     for (;;) {
+          struct gb_gpu_render_job *job;
+          struct gb_gpu_line line;
+
+          sem_wait(&r->ready);
+
+          job = &r->queue[r->tail];
+
+          switch (job->cmd) {
+          case GB_GPU_RENDER_LINE:
+               line.gpu = &job->gpu;
+               line.vram = r->vram[job->vram_snapshot];
+               line.gbc = gb->gbc;
+
+               gb_gpu_render_line(gb, &line);
+
+               atomic_fetch_sub(&r->vram_users[job->vram_snapshot], 1);
+               break;
+          case GB_GPU_RENDER_FLUSH:
+               sem_post(&r->idle);
+               break;
+          case GB_GPU_RENDER_QUIT:
+               return NULL;
+          }
+
+          r->tail = (r->tail + 1) % GB_GPU_RENDER_QUEUE_LEN;
+          sem_post(&r->free);
+     }
+}
+
+/* Get the next free job in the queue, blocking if the render thread is
+ * lagging too far behind */
+static struct gb_gpu_render_job *gb_gpu_render_job_get(struct gb *gb) {
+     struct gb_gpu_renderer *r = gb->gpu.renderer;
+
+     sem_wait(&r->free);
+
+     return &r->queue[r->head];
+}
+
+/* Send the job previously returned by gb_gpu_render_job_get to the render
+ * thread */
+static void gb_gpu_render_job_push(struct gb *gb) {
+     struct gb_gpu_renderer *r = gb->gpu.renderer;
+
+     r->head = (r->head + 1) % GB_GPU_RENDER_QUEUE_LEN;
+     sem_post(&r->ready);
+}
+
+/* Wait for the render thread to finish drawing all the queued lines. Does
+ * nothing if the render thread isn't running. */
+void gb_gpu_render_flush(struct gb *gb) {
+     struct gb_gpu_renderer *r = gb->gpu.renderer;
+     struct gb_gpu_render_job *job;
+
+     if (r == NULL) {
+          return;
+     }
+
+     job = gb_gpu_render_job_get(gb);
+     job->cmd = GB_GPU_RENDER_FLUSH;
+     gb_gpu_render_job_push(gb);
+
+     sem_wait(&r->idle);
+}
+
+/* Queue the current line for rendering in the render thread */
+static void gb_gpu_queue_cur_line(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+     struct gb_gpu_renderer *r = gpu->renderer;
+     struct gb_gpu_render_job *job;
+
+     if (gpu->vram_dirty) {
+          /* VRAM changed since the last line, we need a fresh snapshot */
+          unsigned next = (r->cur_vram + 1) % GB_GPU_VRAM_SNAPSHOTS;
+
+          if (atomic_load(&r->vram_users[next]) != 0) {
+               /* The render thread is still using this snapshot, wait for it
+                * to catch up */
+               gb_gpu_render_flush(gb);
+          }
+
+          memcpy(r->vram[next], gb->vram, GB_VRAM_SIZE(gb->gbc));
+          r->cur_vram = next;
+          gpu->vram_dirty = false;
+     }
+
+     atomic_fetch_add(&r->vram_users[r->cur_vram], 1);
+
+     job = gb_gpu_render_job_get(gb);
+     job->cmd = GB_GPU_RENDER_LINE;
+     job->gpu = *gpu;
+     job->vram_snapshot = r->cur_vram;
+     gb_gpu_render_job_push(gb);
+}
+
+static void gb_gpu_draw_cur_line(struct gb *gb) {
+     struct gb_gpu_line line;
+
+     if (gb->gpu.renderer) {
+          gb_gpu_queue_cur_line(gb);
+          return;
+     }
+
+     line.gpu = &gb->gpu;
+     line.vram = gb->vram;
+     line.gbc = gb->gbc;
+
+     gb_gpu_render_line(gb, &line);
+}
+
+void gb_gpu_render_thread_start(struct gb *gb) {
+     struct gb_gpu_renderer *r;
+     unsigned i;
+
+     r = calloc(1, sizeof(*r));
+     if (r == NULL) {
+          perror("Can't allocate GPU renderer");
+          die();
+     }
+
+     r->head = 0;
+     r->tail = 0;
+     r->cur_vram = 0;
+
+     for (i = 0; i < GB_GPU_VRAM_SNAPSHOTS; i++) {
+          atomic_init(&r->vram_users[i], 0);
+     }
+
+     sem_init(&r->ready, 0, 0);
+     sem_init(&r->free, 0, GB_GPU_RENDER_QUEUE_LEN);
+     sem_init(&r->idle, 0, 0);
+
+     /* Force a VRAM snapshot for the first line */
+     gb->gpu.vram_dirty = true;
+     gb->gpu.renderer = r;
+
+     if (pthread_create(&r->thread, NULL, gb_gpu_render_thread, gb) != 0) {
+          perror("Can't create render thread");
+          die();
+     }
+}
+
+void gb_gpu_render_thread_stop(struct gb *gb) {
+     struct gb_gpu_renderer *r = gb->gpu.renderer;
+     struct gb_gpu_render_job *job;
+
+     if (r == NULL) {
+          return;
+     }
+
+     job = gb_gpu_render_job_get(gb);
+     job->cmd = GB_GPU_RENDER_QUIT;
+     gb_gpu_render_job_push(gb);
+
+     pthread_join(r->thread, NULL);
+
+     sem_destroy(&r->ready);
+     sem_destroy(&r->free);
+     sem_destroy(&r->idle);
+
+     free(r);
+     gb->gpu.renderer = NULL;
+}
+
+/* Fill the frame buffer with white pixels */
+static void gb_gpu_clear_screen(struct gb *gb) {
+     struct gb_framebuffer *fb = &gb->frontend.fb;
+     uint8_t index = gb->gbc ? GB_GPU_GBC_LCD_OFF : GB_COL_WHITE;
+     uint32_t white = gb->gpu.fb_palette[index];
+     unsigned x;
+     unsigned y;
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          uint8_t *out = (uint8_t *)fb->pixels + y * fb->pitch;
+
+          switch (fb->format) {
+          case GB_PIXEL_INDEXED8:
+               memset(out, index, GB_LCD_WIDTH);
+               break;
+          case GB_PIXEL_RGB565:
+               for (x = 0; x < GB_LCD_WIDTH; x++) {
+                    ((uint16_t *)out)[x] = white;
+               }
+               break;
+          case GB_PIXEL_XRGB8888:
+               for (x = 0; x < GB_LCD_WIDTH; x++) {
+                    ((uint32_t *)out)[x] = white;
+               }
+               break;
+          }
      }
 }
 
@@ -604,7 +998,19 @@ void gb_gpu_sync(struct gb *gb) {
 
                if (gpu->ly == VSYNC_START) {
                     /* We're done drawing the current frame */
+                    gb_gpu_render_flush(gb);
+                    if (gpu->video_capture) {
+                         gb_video_capture_frame(gb);
+                    }
+                    if (gb->hash_log) {
+                         gb_hash_log_frame(gb);
+                    }
                     gb->frontend.flip(gb);
+                    gpu->frames++;
+                    /* Apply the input events received up to this frame. The
+                     * game will usually read them during VBLANK anyway but
+                     * this way the input interrupt is not delayed. */
+                    gb_input_drain(gb);
                     gb_irq_trigger(gb, GB_IRQ_VSYNC);
 
                     if (gpu->iten_mode1) {
@@ -705,17 +1111,10 @@ void gb_gpu_set_lcdc(struct gb *gb, uint8_t lcdc) {
           gpu->master_enable = master_enable;
 
           if (master_enable == false) {
-               union gb_gpu_color line[GB_LCD_WIDTH];
-               unsigned i;
-
-               /* Clear the screen */
-               for (i = 0; i < GB_LCD_WIDTH; i++) {
-                    line[i].dmg_color = GB_COL_WHITE;
-               }
-
-               for (i = 0; i < GB_LCD_HEIGHT; i++) {
-                    gb->frontend.draw_line_dmg(gb, i, line);
-               }
+               /* Make sure the render thread won't draw over the cleared
+                * screen */
+               gb_gpu_render_flush(gb);
+               gb_gpu_clear_screen(gb);
 
                gpu->ly = 0;
                gpu->line_pos = 0;
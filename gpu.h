@@ -14,13 +14,42 @@ enum gb_color {
 #define GB_LCD_WIDTH  160
 #define GB_LCD_HEIGHT 144
 
-union gb_gpu_color {
-     /* DMG color: 4 shades */
-     enum gb_color dmg_color;
-     /* GBC color: xRGB 1555 */
-     uint16_t gbc_color;
+enum gb_pixel_format {
+     /* 8 bits per pixel. In DMG mode this is the shade (see enum gb_color), in
+      * GBC mode it's the index of the color in palette RAM: 0-31 for the
+      * background palettes, 32-63 for the sprite palettes, 64 for blank
+      * pixels and 65 for the white screen displayed while the LCD is off. */
+     GB_PIXEL_INDEXED8,
+     /* 16 bits per pixel: RGB 565 */
+     GB_PIXEL_RGB565,
+     /* 32 bits per pixel: xRGB 8888 */
+     GB_PIXEL_XRGB8888,
 };
 
+/* Buffer the GPU renders the frames into */
+struct gb_framebuffer {
+     /* Top-left pixel of the frame. Must be large enough to hold GB_LCD_HEIGHT
+      * lines of `pitch` bytes. */
+     void *pixels;
+     /* Offset in bytes between the start of two consecutive lines */
+     unsigned pitch;
+     /* Format of the pixels in the buffer */
+     enum gb_pixel_format format;
+};
+
+/* Size in bytes of the pixels of one line, without the padding */
+static inline unsigned
+gb_framebuffer_line_size(const struct gb_framebuffer *fb) {
+     switch (fb->format) {
+     case GB_PIXEL_RGB565:
+          return GB_LCD_WIDTH * 2;
+     case GB_PIXEL_XRGB8888:
+          return GB_LCD_WIDTH * 4;
+     default:
+          return GB_LCD_WIDTH;
+     }
+}
+
 /* Palette used by the GBC */
 struct gb_color_palette {
      /* 8 palettes of 4 colors. Each color is stored as xBGR 1555 */
@@ -31,6 +60,15 @@ struct gb_color_palette {
      bool auto_increment;
 };
 
+/* In GBC mode the pixel index of pixels that have neither background nor
+ * sprite. Displayed as black. */
+#define GB_GPU_GBC_BLANK 64
+/* In GBC mode the pixel index of the screen while the LCD is off. Displayed as
+ * white. */
+#define GB_GPU_GBC_LCD_OFF 65
+/* Number of colors a pixel index can reference */
+#define GB_GPU_PALETTE_SIZE (GB_GPU_GBC_LCD_OFF + 1)
+
 struct gb_gpu {
      /* Background scroll X */
      uint8_t scx;
@@ -76,6 +114,8 @@ struct gb_gpu {
      uint8_t wy;
      /* Current position within the current line */
      uint16_t line_pos;
+     /* Number of frames completed since power on */
+     uint32_t frames;
      /* Object Attribute Memory (sprite configuration). Each sprite uses 4 bytes
       * for attributes. */
      uint8_t oam[GB_GPU_MAX_SPRITES * 4];
@@ -83,14 +123,30 @@ struct gb_gpu {
      struct gb_color_palette bg_palettes;
      /* GBC-only: sprite color palettes */
      struct gb_color_palette sprite_palettes;
+     /* Color of every pixel index (see enum gb_pixel_format) already
+      * converted to the frame buffer's pixel format. In GBC mode it's updated
+      * every time the palette RAM is written to. */
+     uint32_t fb_palette[GB_GPU_PALETTE_SIZE];
+     /* True if VRAM has been modified since the render thread last took a
+      * snapshot */
+     bool vram_dirty;
+     /* Render thread state, NULL if lines are rendered synchronously */
+     struct gb_gpu_renderer *renderer;
+     /* Video capture, or NULL if the frames aren't captured */
+     struct gb_video_capture *video_capture;
 };
 
 void gb_gpu_reset(struct gb *gb);
+void gb_gpu_fb_palette_reload(struct gb *gb);
 void gb_gpu_sync(struct gb *gb);
 void gb_gpu_set_lcd_stat(struct gb *gb, uint8_t stat);
 void gb_gpu_set_lcdc(struct gb *gb, uint8_t stat);
 uint8_t gb_gpu_get_lcdc(struct gb *gb);
 uint8_t gb_gpu_get_ly(struct gb *gb);
 uint8_t gb_gpu_get_lcd_stat(struct gb *gb);
+void gb_gpu_render_thread_start(struct gb *gb);
+void gb_gpu_render_thread_stop(struct gb *gb);
+void gb_gpu_render_flush(struct gb *gb);
+void gb_gpu_palette_write(struct gb *gb, bool sprite, uint8_t v);
 
 #endif /* _GB_GPU_H_ */
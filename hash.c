@@ -0,0 +1,152 @@
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+/* The SSE4.2 CRC32 instruction computes this exact polynomial. It's used
+ * whenever the CPU supports it, even if the build doesn't enable SSE4.2 */
+#define GB_CRC32C_SSE42
+#endif
+#include "gb.h"
+
+/* CRC-32C (Castagnoli), reflected polynomial */
+#define GB_CRC32C_POLY 0x82f63b78U
+
+static uint32_t gb_crc32c_table[256];
+static pthread_once_t gb_crc32c_once = PTHREAD_ONCE_INIT;
+/* Implementation selected by `gb_crc32c_init`. Works on the inverted CRC */
+static uint32_t (*gb_crc32c_update)(uint32_t crc, const uint8_t *p,
+                                    size_t len);
+
+static uint32_t gb_crc32c_update_table(uint32_t crc, const uint8_t *p,
+                                       size_t len) {
+     for (; len; len--, p++) {
+          crc = (crc >> 8) ^ gb_crc32c_table[(crc ^ *p) & 0xff];
+     }
+
+     return crc;
+}
+
+#ifdef GB_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t gb_crc32c_update_sse42(uint32_t crc, const uint8_t *p,
+                                       size_t len) {
+#ifdef __x86_64__
+     for (; len >= 8; len -= 8, p += 8) {
+          uint64_t v;
+
+          memcpy(&v, p, sizeof(v));
+          crc = _mm_crc32_u64(crc, v);
+     }
+#endif
+     for (; len >= 4; len -= 4, p += 4) {
+          uint32_t v;
+
+          memcpy(&v, p, sizeof(v));
+          crc = _mm_crc32_u32(crc, v);
+     }
+
+     for (; len; len--, p++) {
+          crc = _mm_crc32_u8(crc, *p);
+     }
+
+     return crc;
+}
+#endif
+
+static void gb_crc32c_init(void) {
+     unsigned i, j;
+
+#ifdef GB_CRC32C_SSE42
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("sse4.2")) {
+          gb_crc32c_update = gb_crc32c_update_sse42;
+          return;
+     }
+#endif
+
+     for (i = 0; i < 256; i++) {
+          uint32_t c = i;
+
+          for (j = 0; j < 8; j++) {
+               c = (c >> 1) ^ ((c & 1) ? GB_CRC32C_POLY : 0);
+          }
+
+          gb_crc32c_table[i] = c;
+     }
+
+     gb_crc32c_update = gb_crc32c_update_table;
+}
+
+/* Update `crc` with `len` bytes of `data`. Start with a CRC of 0. */
+uint32_t gb_crc32c(uint32_t crc, const void *data, size_t len) {
+     pthread_once(&gb_crc32c_once, gb_crc32c_init);
+
+     return ~gb_crc32c_update(~crc, data, len);
+}
+
+/* Start logging the CRC of every frame and of the audio samples generated
+ * during that frame to `path` */
+void gb_hash_log_open(struct gb *gb, const char *path) {
+     struct gb_hash_log *log;
+
+     log = malloc(sizeof(*log));
+     if (log == NULL) {
+          perror("Malloc failed");
+          die();
+     }
+
+     log->file = fopen(path, "w");
+     if (log->file == NULL) {
+          perror("Can't open hash log");
+          die();
+     }
+
+     log->audio_crc = 0;
+
+     gb->hash_log = log;
+}
+
+/* Called by the SPU with the samples sent to the frontend */
+void gb_hash_log_audio(struct gb *gb, const int16_t (*frames)[2], unsigned n) {
+     struct gb_hash_log *log = gb->hash_log;
+
+     log->audio_crc = gb_crc32c(log->audio_crc, frames, n * sizeof(*frames));
+}
+
+/* Called on every flip, before the frame is handed over to the frontend */
+void gb_hash_log_frame(struct gb *gb) {
+     struct gb_hash_log *log = gb->hash_log;
+     const struct gb_framebuffer *fb = &gb->frontend.fb;
+     unsigned line_size = gb_framebuffer_line_size(fb);
+     uint32_t video_crc = 0;
+     unsigned y;
+
+     /* Ignore the padding at the end of the lines */
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          video_crc = gb_crc32c(video_crc,
+                                (const uint8_t *)fb->pixels + y * fb->pitch,
+                                line_size);
+     }
+
+     /* Make sure that all the samples up to this point have been generated.
+      * This doesn't change the output, only when it's computed. */
+     if (gb->spu.output_enabled) {
+          gb_spu_sync(gb);
+     }
+
+     fprintf(log->file, "%u %08x %08x\n",
+             gb->gpu.frames, video_crc, log->audio_crc);
+
+     log->audio_crc = 0;
+}
+
+void gb_hash_log_close(struct gb *gb) {
+     struct gb_hash_log *log = gb->hash_log;
+
+     if (log == NULL) {
+          return;
+     }
+
+     fclose(log->file);
+     free(log);
+     gb->hash_log = NULL;
+}
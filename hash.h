@@ -0,0 +1,19 @@
+#ifndef _GB_HASH_H_
+#define _GB_HASH_H_
+
+/* Per-frame fingerprints of the video and audio output, used to detect
+ * accuracy regressions by comparing the logs of two builds */
+struct gb_hash_log {
+     FILE *file;
+     /* CRC of the audio samples generated since the last frame */
+     uint32_t audio_crc;
+};
+
+uint32_t gb_crc32c(uint32_t crc, const void *data, size_t len);
+
+void gb_hash_log_open(struct gb *gb, const char *path);
+void gb_hash_log_audio(struct gb *gb, const int16_t (*frames)[2], unsigned n);
+void gb_hash_log_frame(struct gb *gb);
+void gb_hash_log_close(struct gb *gb);
+
+#endif /* _GB_HASH_H_ */
@@ -0,0 +1,85 @@
+#include <time.h>
+#include <sys/resource.h>
+#include "gb.h"
+#include "headless.h"
+
+/* Frontend without any display, audio or input. Useful to benchmark the
+ * emulator or to capture its output. */
+struct gb_headless_context {
+     /* Time of the first frame */
+     struct timespec start;
+     /* Number of frames displayed so far */
+     unsigned frames;
+     /* Quit once the emulated console has produced that many frames since
+      * power on (including the ones restored from a snapshot), 0 to run
+      * forever */
+     unsigned max_frames;
+     /* Frame buffer the GPU draws into */
+     uint32_t pixels[GB_LCD_WIDTH * GB_LCD_HEIGHT];
+};
+
+static void gb_headless_flip(struct gb *gb) {
+     struct gb_headless_context *ctx = gb->frontend.data;
+
+     if (ctx->frames == 0) {
+          clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+     }
+
+     ctx->frames++;
+
+     /* `gpu.frames` is incremented after the flip */
+     if (ctx->max_frames != 0 && gb->gpu.frames + 1 >= ctx->max_frames) {
+          gb->quit = true;
+     }
+}
+
+static void gb_headless_refresh_input(struct gb *gb) {
+     (void)gb;
+}
+
+static void gb_headless_destroy(struct gb *gb) {
+     struct gb_headless_context *ctx = gb->frontend.data;
+     struct timespec now;
+     struct rusage usage;
+     double elapsed;
+
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     elapsed = (now.tv_sec - ctx->start.tv_sec) +
+          (now.tv_nsec - ctx->start.tv_nsec) / 1e9;
+
+     if (ctx->frames > 1 && elapsed > 0) {
+          /* The first frame is the start of the measurement */
+          printf("Ran %u frames in %.3fs (%.1f FPS)\n", ctx->frames,
+                 elapsed, (ctx->frames - 1) / elapsed);
+     } else {
+          printf("Ran %u frames\n", ctx->frames);
+     }
+
+     if (getrusage(RUSAGE_SELF, &usage) == 0) {
+          printf("Max RSS: %ldKiB\n", usage.ru_maxrss);
+     }
+
+     free(ctx);
+     gb->frontend.data = NULL;
+}
+
+void gb_headless_frontend_init(struct gb *gb, unsigned max_frames) {
+     struct gb_headless_context *ctx;
+
+     ctx = calloc(1, sizeof(*ctx));
+     if (ctx == NULL) {
+          perror("Malloc failed");
+          die();
+     }
+
+     ctx->frames = 0;
+     ctx->max_frames = max_frames;
+
+     gb->frontend.data = ctx;
+     gb->frontend.fb.pixels = ctx->pixels;
+     gb->frontend.fb.pitch = GB_LCD_WIDTH * sizeof(*ctx->pixels);
+     gb->frontend.fb.format = GB_PIXEL_XRGB8888;
+     gb->frontend.flip = gb_headless_flip;
+     gb->frontend.refresh_input = gb_headless_refresh_input;
+     gb->frontend.destroy = gb_headless_destroy;
+}
@@ -0,0 +1,6 @@
+#ifndef _GB_HEADLESS_H_
+#define _GB_HEADLESS_H_
+
+void gb_headless_frontend_init(struct gb *gb, unsigned max_frames);
+
+#endif /* _GB_HEADLESS_H_ */
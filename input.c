@@ -7,15 +7,34 @@ void gb_input_reset(struct gb *gb) {
      input->dpad_selected = false;
      input->buttons_state = ~0x20;
      input->buttons_selected = false;
+     atomic_init(&input->queue_head, 0);
+     atomic_init(&input->queue_tail, 0);
+     atomic_init(&input->dropped, 0);
 }
 
-void gb_input_set(struct gb *gb, unsigned button, bool pressed) {
+/* Returns the value of the input register */
+static uint8_t gb_input_state(struct gb *gb) {
+     struct gb_input *input = &gb->input;
+     uint8_t v = 0xff;
+
+     if (input->dpad_selected) {
+          v &= input->dpad_state;
+     }
+
+     if (input->buttons_selected) {
+          v &= input->buttons_state;
+     }
+
+     return v;
+}
+
+static void gb_input_set(struct gb *gb, unsigned button, bool pressed) {
      struct gb_input *input = &gb->input;
      uint8_t *state;
      uint8_t prev_state;
      unsigned bit;
 
-     prev_state = gb_input_get_state(gb);
+     prev_state = gb_input_state(gb);
 
      if (button <= GB_INPUT_DOWN) {
           state = &input->dpad_state;
@@ -34,7 +53,7 @@ void gb_input_set(struct gb *gb, unsigned button, bool pressed) {
           *state |= 1U << bit;
      }
 
-     if (pressed && prev_state != gb_input_get_state(gb)) {
+     if (pressed && prev_state != gb_input_state(gb)) {
           /* A button was pressed and it's currently selected, that means that
            * we have a negative edge on one of the input terminal which triggers
            * the interrupt. This should also get us out of a STOP state. */
@@ -49,17 +68,68 @@ void gb_input_select(struct gb *gb, uint8_t selection) {
      input->buttons_selected = ((selection & 0x20) == 0);
 }
 
-uint8_t gb_input_get_state(struct gb *gb) {
+/* Called by the frontend when a button is pressed or released. The event is
+ * only applied the next time the game reads the input register or at the
+ * start of the next VBLANK, whichever comes first. Can be called from any
+ * thread as long as there's only one. */
+void gb_input_push(struct gb *gb, unsigned button, bool pressed) {
      struct gb_input *input = &gb->input;
-     uint8_t v = 0xff;
+     unsigned head = atomic_load_explicit(&input->queue_head,
+                                          memory_order_relaxed);
+     unsigned tail = atomic_load_explicit(&input->queue_tail,
+                                          memory_order_acquire);
+     struct gb_input_event *e;
 
-     if (input->dpad_selected) {
-          v &= input->dpad_state;
+     if (head - tail >= GB_INPUT_QUEUE_SIZE) {
+          /* The emulation is stalled, drop the event. We don't print
+           * anything here since it could happen for every event, the total
+           * is reported by `gb_input_print_stats` */
+          atomic_fetch_add_explicit(&input->dropped, 1,
+                                    memory_order_relaxed);
+          return;
      }
 
-     if (input->buttons_selected) {
-          v &= input->buttons_state;
+     e = &input->queue[head & (GB_INPUT_QUEUE_SIZE - 1)];
+     e->button = button;
+     e->pressed = pressed;
+
+     atomic_store_explicit(&input->queue_head, head + 1, memory_order_release);
+}
+
+/* Apply all the events pushed by the frontend so far */
+void gb_input_drain(struct gb *gb) {
+     struct gb_input *input = &gb->input;
+     unsigned tail = atomic_load_explicit(&input->queue_tail,
+                                          memory_order_relaxed);
+     unsigned head = atomic_load_explicit(&input->queue_head,
+                                          memory_order_acquire);
+
+     if (tail == head) {
+          return;
      }
 
-     return v;
+     for (; tail != head; tail++) {
+          const struct gb_input_event *e =
+               &input->queue[tail & (GB_INPUT_QUEUE_SIZE - 1)];
+
+          gb_input_set(gb, e->button, e->pressed);
+     }
+
+     atomic_store_explicit(&input->queue_tail, tail, memory_order_release);
+}
+
+uint8_t gb_input_get_state(struct gb *gb) {
+     gb_input_drain(gb);
+
+     return gb_input_state(gb);
+}
+
+/* Report the events dropped because the queue was full, if any. Must be
+ * called once the frontend has stopped pushing events. */
+void gb_input_print_stats(struct gb *gb) {
+     unsigned dropped = atomic_load(&gb->input.dropped);
+
+     if (dropped) {
+          fprintf(stderr, "Input queue: %u events dropped\n", dropped);
+     }
 }
@@ -10,6 +10,15 @@
 #define GB_INPUT_SELECT 6
 #define GB_INPUT_START  7
 
+/* Number of events that can wait in the input queue. Must be a power of two */
+#define GB_INPUT_QUEUE_SIZE 64
+
+struct gb_input_event {
+     /* One of the GB_INPUT_* values */
+     uint8_t button;
+     bool pressed;
+};
+
 struct gb_input {
      /* State of the D-pad (right, left, up, down), active low */
      uint8_t dpad_state;
@@ -19,11 +28,24 @@ struct gb_input {
      uint8_t buttons_state;
      /* True if the buttons are selected */
      bool buttons_selected;
+     /* Events pushed by the frontend and not yet applied. The frontend is the
+      * only producer and the emulation thread the only consumer, so it can be
+      * accessed without locking. */
+     struct gb_input_event queue[GB_INPUT_QUEUE_SIZE];
+     /* Index of the next event to be pushed */
+     atomic_uint queue_head;
+     /* Index of the next event to be applied */
+     atomic_uint queue_tail;
+     /* Number of events dropped because the queue was full. Only written by
+      * the frontend */
+     atomic_uint dropped;
 };
 
 void gb_input_reset(struct gb *gb);
-void gb_input_set(struct gb *gb, unsigned button, bool pressed);
+void gb_input_push(struct gb *gb, unsigned button, bool pressed);
+void gb_input_drain(struct gb *gb);
 void gb_input_select(struct gb *gb, uint8_t selection);
 uint8_t gb_input_get_state(struct gb *gb);
+void gb_input_print_stats(struct gb *gb);
 
 #endif /* _GB_INPUT_H_ */
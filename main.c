@@ -1,44 +1,280 @@
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 #include "gb.h"
 #include "sdl.h"
+#include "headless.h"
+
+/* Parse the argument of -T. Returns 0 on success, -1 on error. */
+static int parse_rtc_clock(const char *arg, enum gb_rtc_clock *clock,
+                           uint64_t *t) {
+     const char *colon = strchr(arg, ':');
+     size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+     char *end;
+
+     if (len == 4 && strncmp(arg, "wall", len) == 0 && colon == NULL) {
+          *clock = GB_RTC_CLOCK_WALL;
+          return 0;
+     }
+
+     if (len == 8 && strncmp(arg, "emulated", len) == 0) {
+          *clock = GB_RTC_CLOCK_EMULATED;
+          if (colon == NULL) {
+               /* Start at the epoch so that the runs are reproducible */
+               *t = 0;
+               return 0;
+          }
+     } else if (len == 5 && strncmp(arg, "fixed", len) == 0 && colon) {
+          *clock = GB_RTC_CLOCK_FIXED;
+     } else {
+          return -1;
+     }
+
+     *t = strtoull(colon + 1, &end, 0);
+     if (end == colon + 1 || *end != '\0') {
+          return -1;
+     }
+
+     return 0;
+}
+
+/* Default number of frames covered by the boot snapshots */
+#define DEFAULT_BOOT_FRAMES 600
+
+static void usage(const char *name) {
+     fprintf(stderr, "Usage: %s [options] <rom>\n", name);
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -t      Render the video output in a dedicated thread\n");
+     fprintf(stderr, "  -s <n>  Upscale the video by a factor n (2-4) on the "
+             "CPU\n");
+     fprintf(stderr, "  -x      Upscale the video with Scale2x (implies -s 2)\n");
+     fprintf(stderr, "  -c      Emulate the colors of the GBC's LCD\n");
+     fprintf(stderr, "  -a <n>  Size of the audio buffer in sample frames "
+             "(default %u)\n", GB_SPU_RING_DEFAULT_FRAMES);
+     fprintf(stderr, "  -r <hz> Synthesize band-limited audio at the given "
+             "sample rate\n");
+     fprintf(stderr, "  -f      Filter out the DC offset of the audio "
+             "output\n");
+     fprintf(stderr, "  -n      Disable the audio output and run as fast as "
+             "possible\n");
+     fprintf(stderr, "  -d      Dynamic rate control: pace the emulation with "
+             "the display's\n"
+             "          vsync and adjust the audio rate to match\n");
+     fprintf(stderr, "  -w <f>  Capture the audio output to f (WAV if it ends "
+             "in .wav,\n"
+             "          raw PCM otherwise, - for stdout)\n");
+     fprintf(stderr, "  -v <f>  Capture the video output to f (Y4M if it ends "
+             "in .y4m,\n"
+             "          raw RGB24 otherwise, - for stdout)\n");
+     fprintf(stderr, "  -l <f>  Log the CRC of every frame and of its audio "
+             "to f\n");
+     fprintf(stderr, "  -S <f>  Use f as the save file (default: the ROM path "
+             "with a .sav\n"
+             "          extension)\n");
+     fprintf(stderr, "  -m      Map the save file in memory instead of "
+             "rewriting it\n");
+     fprintf(stderr, "  -T <c>  Time source of the cartridge RTC: wall "
+             "(default),\n"
+             "          emulated[:<t>] or fixed:<t>, t being a Unix time\n"
+             "          (0 by default)\n");
+     fprintf(stderr, "  -H <n>  Run headless for n frames (0 to run "
+             "forever)\n");
+     fprintf(stderr, "  -k <d>  Headless only: start from the snapshot of the "
+             "boot sequence\n"
+             "          cached in directory d, creating it if needed\n");
+     fprintf(stderr, "  -B <n>  Length of the boot sequence in frames "
+             "(default %u)\n", DEFAULT_BOOT_FRAMES);
+}
 
 int main(int argc, char **argv) {
      struct gb *gb;
      const char *rom_file;
-     unsigned i;
+     bool render_thread = false;
+     unsigned cpu_scale = 1;
+     bool scale2x = false;
+     bool color_correction = false;
+     unsigned audio_frames = GB_SPU_RING_DEFAULT_FRAMES;
+     bool rate_control = false;
+     unsigned sample_rate = 0;
+     bool audio = true;
+     bool dc_filter = false;
+     const char *audio_capture = NULL;
+     const char *video_capture = NULL;
+     const char *hash_log = NULL;
+     bool map_save = false;
+     char *save_file = NULL;
+     bool headless = false;
+     unsigned headless_frames = 0;
+     enum gb_rtc_clock rtc_clock = GB_RTC_CLOCK_WALL;
+     uint64_t rtc_time = 0;
+     const char *snapshot_dir = NULL;
+     unsigned boot_frames = DEFAULT_BOOT_FRAMES;
+     char *snapshot_path = NULL;
+     struct timespec start;
+     int opt;
+
+     clock_gettime(CLOCK_MONOTONIC, &start);
 
-     if (argc < 2) {
-          fprintf(stderr, "Usage: %s <rom>\n", argv[0]);
+     while ((opt = getopt(argc, argv, "ts:xca:dr:nfw:v:l:S:mT:H:k:B:")) != -1) {
+          switch (opt) {
+          case 't':
+               render_thread = true;
+               break;
+          case 's':
+               cpu_scale = atoi(optarg);
+               break;
+          case 'x':
+               scale2x = true;
+               cpu_scale = 2;
+               break;
+          case 'c':
+               color_correction = true;
+               break;
+          case 'a':
+               audio_frames = atoi(optarg);
+               break;
+          case 'd':
+               rate_control = true;
+               break;
+          case 'r':
+               sample_rate = atoi(optarg);
+               break;
+          case 'n':
+               audio = false;
+               break;
+          case 'f':
+               dc_filter = true;
+               break;
+          case 'w':
+               audio_capture = optarg;
+               break;
+          case 'v':
+               video_capture = optarg;
+               break;
+          case 'l':
+               hash_log = optarg;
+               break;
+          case 'S':
+               free(save_file);
+               save_file = strdup(optarg);
+               break;
+          case 'm':
+               map_save = true;
+               break;
+          case 'T':
+               if (parse_rtc_clock(optarg, &rtc_clock, &rtc_time) < 0) {
+                    fprintf(stderr, "Invalid RTC time source '%s'\n",
+                            optarg);
+                    return EXIT_FAILURE;
+               }
+               break;
+          case 'H':
+               headless = true;
+               headless_frames = atoi(optarg);
+               break;
+          case 'k':
+               snapshot_dir = optarg;
+               break;
+          case 'B':
+               boot_frames = atoi(optarg);
+               break;
+          default:
+               usage(argv[0]);
+               return EXIT_FAILURE;
+          }
+     }
+
+     if (optind >= argc) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+     }
+
+     /* We need to be able to hold at least one batch of samples generated
+      * between two calls to `gb_spu_ring_wait` below */
+     if (!headless && audio_frames < GB_SPU_SYNC_FRAMES * 2) {
+          fprintf(stderr, "Audio buffer must be at least %u frames long\n",
+                  GB_SPU_SYNC_FRAMES * 2);
+          return EXIT_FAILURE;
+     }
+
+     if (audio_capture && !audio) {
+          fprintf(stderr, "Can't capture the audio with the output "
+                  "disabled\n");
+          return EXIT_FAILURE;
+     }
+
+     if (audio_capture && video_capture &&
+         strcmp(audio_capture, "-") == 0 && strcmp(video_capture, "-") == 0) {
+          fprintf(stderr, "Can't capture both audio and video to stdout\n");
+          return EXIT_FAILURE;
+     }
+
+     /* The boot sequence is only canonical if there's no input */
+     if (snapshot_dir && !headless) {
+          fprintf(stderr, "Boot snapshots are only supported in headless "
+                  "mode\n");
+          return EXIT_FAILURE;
+     }
+
+     if (headless) {
+          /* There's nobody to consume the samples so we only generate them
+           * if they're captured or hashed, and we don't need a ring */
+          audio_frames = 0;
+          audio = audio && (audio_capture != NULL || hash_log != NULL);
+     }
+
+     if (sample_rate != 0 &&
+         (sample_rate < 8000 || sample_rate > GB_SPU_SAMPLE_RATE_HZ)) {
+          fprintf(stderr, "Unsupported sample rate %u\n", sample_rate);
           return EXIT_FAILURE;
      }
 
      /* Our context contains semaphores, so we allocate it on the heap so that
       * it remains visible to all threads no matter what. */
-     gb = calloc(1, sizeof(*gb));
+     gb = gb_alloc();
      if (gb == NULL) {
-          perror("calloc failed");
+          perror("Can't allocate emulator context");
           return EXIT_FAILURE;
      }
 
-     /* Initialize the semaphores before we start the frontend */
-     for (i = 0; i < GB_SPU_SAMPLE_BUFFER_COUNT; i++) {
-          struct gb_spu_sample_buffer *buf = &gb->spu.buffers[i];
+     gb_color_init(color_correction);
 
-          memset(buf->samples, 0, sizeof(buf->samples));
+     /* Initialize the audio output before we start the frontend */
+     if (audio) {
+          gb_spu_output_init(gb, audio_frames, sample_rate);
+          gb->spu.dc_filter = dc_filter;
 
-          /* We initialize the buffers by saying that they're ready to be sent
-           * to the frontend. This way the frontend won't starve for audio while
-           * we start the emulation. */
-          sem_init(&buf->free, 0, 0);
-          sem_init(&buf->ready, 0, 1);
+          if (audio_capture) {
+               gb_audio_capture_open(gb, audio_capture);
+          }
      }
 
-     gb_sdl_frontend_init(gb);
+     if (headless) {
+          gb_headless_frontend_init(gb, headless_frames);
+     } else {
+          gb_sdl_frontend_init(gb, cpu_scale, scale2x, rate_control,
+                               video_capture != NULL || hash_log != NULL);
+     }
 
-     rom_file = argv[1];
+     if (video_capture) {
+          gb_video_capture_open(gb, video_capture);
+     }
+
+     if (hash_log) {
+          gb_hash_log_open(gb, hash_log);
+     }
+
+     rom_file = argv[optind];
+
+     if (save_file == NULL) {
+          save_file = gb_cart_default_save_file(rom_file);
+     }
 
-     gb_cart_load(gb, rom_file);
+     gb_rtc_set_clock(gb, rtc_clock, rtc_time);
+     gb_cart_load(gb, rom_file, save_file, map_save);
+     free(save_file);
+     gb_memory_init(gb);
      gb_sync_reset(gb);
      gb_irq_reset(gb);
      gb_cpu_reset(gb);
@@ -54,16 +290,85 @@ int main(int argc, char **argv) {
      gb->double_speed = false;
      gb->speed_switch_pending = false;
 
+     if (snapshot_dir) {
+          snapshot_path = gb_snapshot_path(gb, snapshot_dir, boot_frames);
+
+          if (gb_snapshot_load(gb, snapshot_path) == 0) {
+               printf("Resumed from snapshot '%s' at frame %u\n",
+                      snapshot_path, gb->gpu.frames);
+               free(snapshot_path);
+               snapshot_path = NULL;
+          }
+     }
+
+     if (render_thread) {
+          gb_gpu_render_thread_start(gb);
+     }
+
+     if (headless) {
+          /* Benchmark mode, report how long it took to get here */
+          struct timespec now;
+
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          printf("Startup: %.3fms\n",
+                 (now.tv_sec - start.tv_sec) * 1e3 +
+                 (now.tv_nsec - start.tv_nsec) / 1e6);
+     }
+
      while (!gb->quit) {
           gb->frontend.refresh_input(gb);
 
-          /* We refresh the input at 120Hz. This is a trade-off, if we refresh
-           * faster we'll reduce latency at the cost of performance. */
+          /* Input events are queued by the frontend (normally on flip) and
+           * applied when the game reads them. The frontend can also use
+           * `refresh_input` to poll for events when no frame is displayed. */
           gb_cpu_run_cycles(gb, GB_CPU_FREQ_HZ / 120);
+
+          /* Push the samples generated so far to the frontend and wait for
+           * enough room in the ring for the next batch. Without rate control
+           * this is what synchronizes us with the audio output. With rate
+           * control the emulation is paced by the display's vsync and the
+           * ring should never fill up, so the wait is only a safety net.
+           * Without audio nothing paces the emulation unless we use vsync.
+           * The headless frontend has no ring and runs as fast as possible. */
+          if (audio) {
+               gb_spu_sync(gb);
+               if (rate_control) {
+                    gb_spu_drc_update(gb);
+               }
+               if (gb->spu.ring.size) {
+                    gb_spu_ring_wait(&gb->spu.ring,
+                                     gb->spu.sample_rate / 120 + 1);
+               }
+          }
+
+          /* Cache the state at the end of the boot sequence for the next
+           * runs */
+          if (snapshot_path && gb->gpu.frames >= boot_frames) {
+               if (gb_snapshot_save(gb, snapshot_path) == 0) {
+                    printf("Saved snapshot '%s' at frame %u\n",
+                           snapshot_path, gb->gpu.frames);
+               }
+               free(snapshot_path);
+               snapshot_path = NULL;
+          }
      }
 
+     free(snapshot_path);
+
+     gb_gpu_render_thread_stop(gb);
+     gb_video_capture_close(gb);
+     gb_hash_log_close(gb);
      gb->frontend.destroy(gb);
+     gb_input_print_stats(gb);
      gb_cart_unload(gb);
+     gb_memory_destroy(gb);
+
+     if (audio) {
+          if (gb->spu.ring.size) {
+               gb_spu_ring_print_stats(&gb->spu.ring);
+          }
+          gb_spu_output_destroy(gb);
+     }
 
      free(gb);
 
@@ -122,6 +122,29 @@
 /* Internal RAM banking */
 #define REG_SVBK        0xff70U
 
+/* Allocate the internal and video RAM. Must be called once the cartridge has
+ * been loaded since we only allocate the banks the DMG doesn't have if we run
+ * a GBC game */
+void gb_memory_init(struct gb *gb) {
+     unsigned iram_size = GB_IRAM_SIZE(gb->gbc);
+     unsigned vram_size = GB_VRAM_SIZE(gb->gbc);
+
+     /* A single allocation for both */
+     gb->iram = calloc(1, iram_size + vram_size);
+     if (gb->iram == NULL) {
+          perror("Can't allocate RAM");
+          die();
+     }
+
+     gb->vram = gb->iram + iram_size;
+}
+
+void gb_memory_destroy(struct gb *gb) {
+     free(gb->iram);
+     gb->iram = NULL;
+     gb->vram = NULL;
+}
+
 static uint16_t gb_memory_iram_off(struct gb *gb, uint16_t off) {
      if (off >= 0x1000) {
           unsigned bank = gb->iram_high_bank;
@@ -305,8 +328,13 @@ uint8_t gb_memory_readb(struct gb *gb, uint16_t addr) {
      if (addr == REG_NR52) {
           uint8_t r = 0;
 
+          /* Make sure the running flags are up to date */
+          gb_spu_sync(gb);
+
+          r |= gb->spu.nr1.running << 0;
           r |= gb->spu.nr2.running << 1;
           r |= gb->spu.nr3.running << 2;
+          r |= gb->spu.nr4.running << 3;
           r |= gb->spu.enable << 7;
 
           return r;
@@ -506,6 +534,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
 
           gb_gpu_sync(gb);
           gb->vram[off] = val;
+          gb->gpu.vram_dirty = true;
           return;
      }
 
@@ -926,29 +955,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
      }
 
      if (gb->gbc && addr == REG_BCPD) {
-          struct gb_color_palette *p = &gb->gpu.bg_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
-
-          col = p->colors[palette][color_index];
-
-          if (high) {
-               col &= 0xff;
-               col |= val << 8;
-          } else {
-               col &= 0xff00;
-               col |= val;
-          }
-
-          p->colors[palette][color_index] = col;
-
-          if (p->auto_increment) {
-               p->write_index = (p->write_index + 1) & 0x3f;
-          }
-
+          gb_gpu_palette_write(gb, false, val);
           return;
      }
 
@@ -959,29 +966,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
      }
 
      if (gb->gbc && addr == REG_OCPD) {
-          struct gb_color_palette *p = &gb->gpu.sprite_palettes;
-          uint16_t index = p->write_index;
-          unsigned palette = index >> 3;
-          unsigned color_index = (index >> 1) & 3;
-          bool high = index & 1;
-          uint16_t col;
-
-          col = p->colors[palette][color_index];
-
-          if (high) {
-               col &= 0xff;
-               col |= val << 8;
-          } else {
-               col &= 0xff00;
-               col |= val;
-          }
-
-          p->colors[palette][color_index] = col;
-
-          if (p->auto_increment) {
-               p->write_index = (p->write_index + 1) & 0x3f;
-          }
-
+          gb_gpu_palette_write(gb, true, val);
           return;
      }
 
@@ -1,6 +1,13 @@
 #ifndef _GB_MEMORY_H_
 #define _GB_MEMORY_H_
 
+/* Internal RAM size: 8KiB on DMG, 32KiB on GBC */
+#define GB_IRAM_SIZE(_gbc) ((_gbc) ? 0x8000U : 0x2000U)
+/* Video RAM size: 8KiB on DMG, 16KiB on GBC */
+#define GB_VRAM_SIZE(_gbc) ((_gbc) ? 0x4000U : 0x2000U)
+
+void gb_memory_init(struct gb *gb);
+void gb_memory_destroy(struct gb *gb);
 uint8_t gb_memory_readb(struct gb *gb, uint16_t addr);
 void    gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val);
 
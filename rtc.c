@@ -1,8 +1,31 @@
 #include <time.h>
 #include "gb.h"
 
-static uint64_t gb_rtc_system_time(void) {
-     return time(NULL);
+/* Select the time source of the RTC. For GB_RTC_CLOCK_EMULATED `time` is the
+ * time at power on, for GB_RTC_CLOCK_FIXED it's the time returned until the
+ * next call (so it can be scripted by calling this function again while the
+ * emulation runs). It's ignored for GB_RTC_CLOCK_WALL. Must be called before
+ * the cartridge is loaded to have an effect on the initial state of the RTC. */
+void gb_rtc_set_clock(struct gb *gb, enum gb_rtc_clock clock, uint64_t time) {
+     struct gb_rtc *rtc = &gb->cart.rtc;
+
+     rtc->clock = clock;
+     rtc->clock_time = time;
+}
+
+/* Current time in seconds according to the time source */
+static uint64_t gb_rtc_clock_time(struct gb *gb) {
+     struct gb_rtc *rtc = &gb->cart.rtc;
+
+     switch (rtc->clock) {
+     case GB_RTC_CLOCK_EMULATED:
+          return rtc->clock_time + gb_sync_cycles(gb) / GB_CPU_FREQ_HZ;
+     case GB_RTC_CLOCK_FIXED:
+          return rtc->clock_time;
+     case GB_RTC_CLOCK_WALL:
+     default:
+          return time(NULL);
+     }
 }
 
 static bool gb_rtc_is_halted(struct gb *gb) {
@@ -17,7 +40,7 @@ static uint64_t gb_rtc_now_ts(struct gb *gb) {
      if (gb_rtc_is_halted(gb)) {
           return rtc->halt_date;
      } else {
-          return gb_rtc_system_time();
+          return gb_rtc_clock_time(gb);
      }
 }
 
@@ -28,7 +51,10 @@ static void gb_rtc_latch_date(struct gb *gb, struct gb_rtc_date *date) {
      struct gb_rtc *rtc = &gb->cart.rtc;
      uint64_t now = gb_rtc_now_ts(gb);
 
-     if (now >= rtc->base) {
+     /* `base` can be "negative" if the date was set to more than the time of
+      * the clock (with GB_RTC_CLOCK_FIXED at 0 for instance), the difference
+      * is still correct modulo 2^64 */
+     if ((int64_t)(now - rtc->base) >= 0) {
           /* Convert now to a number of seconds relative to the timer's base */
           now = now - rtc->base;
      } else {
@@ -85,10 +111,33 @@ void gb_rtc_set_date(struct gb *gb, const struct gb_rtc_date *date) {
      rtc->base = base;
 }
 
+/* Returns the number of seconds counted by the RTC since 00:00:00 day 0,
+ * without wrapping around */
+uint64_t gb_rtc_elapsed(struct gb *gb) {
+     struct gb_rtc *rtc = &gb->cart.rtc;
+     uint64_t elapsed = gb_rtc_now_ts(gb) - rtc->base;
+
+     return (int64_t)elapsed >= 0 ? elapsed : 0;
+}
+
+/* Recompute `base` (and `halt_date`) so that the RTC has counted `elapsed`
+ * seconds at the current time of its clock. Used to move the RTC state to
+ * another time source. */
+void gb_rtc_set_elapsed(struct gb *gb, uint64_t elapsed) {
+     struct gb_rtc *rtc = &gb->cart.rtc;
+     uint64_t now = gb_rtc_clock_time(gb);
+
+     if (gb_rtc_is_halted(gb)) {
+          rtc->halt_date = now;
+     }
+
+     rtc->base = now - elapsed;
+}
+
 void gb_rtc_init(struct gb *gb) {
      struct gb_rtc *rtc = &gb->cart.rtc;
 
-     rtc->base = gb_rtc_system_time();
+     rtc->base = gb_rtc_clock_time(gb);
      rtc->halt_date = 0;
      rtc->latch = false;
      /* Make sure the HALT bit is 0 */
@@ -155,7 +204,7 @@ void gb_rtc_write(struct gb *gb, unsigned r, uint8_t v) {
           date.dh = v;
 
           if (!was_halted && gb_rtc_is_halted(gb)) {
-               rtc->halt_date = gb_rtc_system_time();
+               rtc->halt_date = gb_rtc_clock_time(gb);
           }
 
           break;
@@ -168,72 +217,63 @@ void gb_rtc_write(struct gb *gb, unsigned r, uint8_t v) {
      gb_rtc_latch_date(gb, &date);
 }
 
-static void gb_dump_u8(FILE *f, uint8_t v) {
-     if (fwrite(&v, 1, 1, f) < 0) {
-          perror("fwrite failed");
-          die();
-     }
+static uint8_t *gb_dump_u8(uint8_t *p, uint8_t v) {
+     *p = v;
+
+     return p + 1;
+}
+
+static uint8_t gb_load_u8(const uint8_t **p) {
+     return *(*p)++;
 }
 
-static uint8_t gb_load_u8(FILE *f) {
-     uint8_t v;
+static uint8_t *gb_dump_u64(uint8_t *p, uint64_t v) {
+     unsigned i;
 
-     if (fread(&v, 1, 1, f) < 1) {
-          fprintf(stderr, "Failed to load RTC state\n");
-          return 0;
+     for (i = 0; i < 8; i++) {
+          p = gb_dump_u8(p, v >> (56 - i * 8));
      }
 
-     return v;
-}
-
-static void gb_dump_u64(FILE *f, uint64_t v) {
-     gb_dump_u8(f, v >> 56);
-     gb_dump_u8(f, v >> 48);
-     gb_dump_u8(f, v >> 40);
-     gb_dump_u8(f, v >> 32);
-     gb_dump_u8(f, v >> 24);
-     gb_dump_u8(f, v >> 16);
-     gb_dump_u8(f, v >> 8);
-     gb_dump_u8(f, v);
+     return p;
 }
 
-static uint64_t gb_load_u64(FILE *f) {
+static uint64_t gb_load_u64(const uint8_t **p) {
      uint64_t v = 0;
+     unsigned i;
 
-     v |= ((uint64_t)gb_load_u8(f)) << 56;
-     v |= ((uint64_t)gb_load_u8(f)) << 48;
-     v |= ((uint64_t)gb_load_u8(f)) << 40;
-     v |= ((uint64_t)gb_load_u8(f)) << 32;
-     v |= ((uint64_t)gb_load_u8(f)) << 24;
-     v |= ((uint64_t)gb_load_u8(f)) << 16;
-     v |= ((uint64_t)gb_load_u8(f)) << 8;
-     v |= ((uint64_t)gb_load_u8(f));
+     for (i = 0; i < 8; i++) {
+          v = (v << 8) | gb_load_u8(p);
+     }
 
      return v;
 }
 
-void gb_rtc_dump(struct gb *gb, FILE *f) {
+/* Serialize the RTC state into `buf`, in the format read by `gb_rtc_load` */
+void gb_rtc_dump(struct gb *gb, uint8_t buf[GB_RTC_DUMP_SIZE]) {
      struct gb_rtc *rtc = &gb->cart.rtc;
-
-     gb_dump_u64(f, rtc->base);
-     gb_dump_u64(f, rtc->halt_date);
-     gb_dump_u8(f, rtc->latch);
-     gb_dump_u8(f, rtc->latched_date.s);
-     gb_dump_u8(f, rtc->latched_date.m);
-     gb_dump_u8(f, rtc->latched_date.h);
-     gb_dump_u8(f, rtc->latched_date.dl);
-     gb_dump_u8(f, rtc->latched_date.dh);
+     uint8_t *p = buf;
+
+     p = gb_dump_u64(p, rtc->base);
+     p = gb_dump_u64(p, rtc->halt_date);
+     p = gb_dump_u8(p, rtc->latch);
+     p = gb_dump_u8(p, rtc->latched_date.s);
+     p = gb_dump_u8(p, rtc->latched_date.m);
+     p = gb_dump_u8(p, rtc->latched_date.h);
+     p = gb_dump_u8(p, rtc->latched_date.dl);
+     gb_dump_u8(p, rtc->latched_date.dh);
 }
 
-void gb_rtc_load(struct gb *gb, FILE *f) {
+/* Restore the RTC state serialized by `gb_rtc_dump` */
+void gb_rtc_load(struct gb *gb, const uint8_t buf[GB_RTC_DUMP_SIZE]) {
      struct gb_rtc *rtc = &gb->cart.rtc;
-
-     rtc->base = gb_load_u64(f);
-     rtc->halt_date = gb_load_u64(f);
-     rtc->latch = gb_load_u8(f);
-     rtc->latched_date.s = gb_load_u8(f);
-     rtc->latched_date.m = gb_load_u8(f);
-     rtc->latched_date.h = gb_load_u8(f);
-     rtc->latched_date.dl = gb_load_u8(f);
-     rtc->latched_date.dh = gb_load_u8(f);
+     const uint8_t *p = buf;
+
+     rtc->base = gb_load_u64(&p);
+     rtc->halt_date = gb_load_u64(&p);
+     rtc->latch = gb_load_u8(&p);
+     rtc->latched_date.s = gb_load_u8(&p);
+     rtc->latched_date.m = gb_load_u8(&p);
+     rtc->latched_date.h = gb_load_u8(&p);
+     rtc->latched_date.dl = gb_load_u8(&p);
+     rtc->latched_date.dh = gb_load_u8(&p);
 }
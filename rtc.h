@@ -1,6 +1,9 @@
 #ifndef _GB_RTC_H_
 #define _GB_RTC_H_
 
+/* Size of the RTC state appended to the save file */
+#define GB_RTC_DUMP_SIZE 22
+
 struct gb_rtc_date {
      /* Second counter value (0-59) */
      uint8_t s;
@@ -14,8 +17,25 @@ struct gb_rtc_date {
      uint8_t dh;
 };
 
+/* Where the RTC gets the current time from */
+enum gb_rtc_clock {
+     /* The host's wall clock: the RTC keeps running while the emulator is
+      * closed, regardless of the emulation speed */
+     GB_RTC_CLOCK_WALL = 0,
+     /* `clock_time` plus the emulated time since power on: the RTC runs at the
+      * speed of the emulation */
+     GB_RTC_CLOCK_EMULATED,
+     /* Always `clock_time`, which can be changed with `gb_rtc_set_clock` */
+     GB_RTC_CLOCK_FIXED,
+};
+
 struct gb_rtc {
-     /* System time corresponding to 00:00:00 day 0 in the emulated RTC time */
+     /* Time source, see `gb_rtc_set_clock` */
+     enum gb_rtc_clock clock;
+     /* Time in seconds used by GB_RTC_CLOCK_EMULATED and GB_RTC_CLOCK_FIXED */
+     uint64_t clock_time;
+     /* Time of the clock corresponding to 00:00:00 day 0 in the emulated RTC
+      * time */
      uint64_t base;
      /* If we're halted this variable contains the date at the time of the halt
       */
@@ -27,11 +47,14 @@ struct gb_rtc {
      struct gb_rtc_date latched_date;
 };
 
+void gb_rtc_set_clock(struct gb *gb, enum gb_rtc_clock clock, uint64_t time);
 void gb_rtc_init(struct gb *gb);
+uint64_t gb_rtc_elapsed(struct gb *gb);
+void gb_rtc_set_elapsed(struct gb *gb, uint64_t elapsed);
 void gb_rtc_latch(struct gb *gb, bool latch);
 uint8_t gb_rtc_read(struct gb *gb, unsigned r);
 void gb_rtc_write(struct gb *gb, unsigned r, uint8_t v);
-void gb_rtc_dump(struct gb *gb, FILE *f);
-void gb_rtc_load(struct gb *gb, FILE *f);
+void gb_rtc_dump(struct gb *gb, uint8_t buf[GB_RTC_DUMP_SIZE]);
+void gb_rtc_load(struct gb *gb, const uint8_t buf[GB_RTC_DUMP_SIZE]);
 
 #endif /* _GB_RTC_H_ */
@@ -0,0 +1,480 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "gb.h"
+
+struct gb_save_snapshot {
+     size_t len;
+     uint8_t data[];
+};
+
+static uint8_t *gb_save_put_u32(uint8_t *p, uint32_t v) {
+     p[0] = v >> 24;
+     p[1] = v >> 16;
+     p[2] = v >> 8;
+     p[3] = v;
+
+     return p + 4;
+}
+
+static uint32_t gb_save_get_u32(const uint8_t *p) {
+     return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Size of the container for layout `l` */
+size_t gb_save_size(const struct gb_save_layout *l) {
+     return GB_SAVE_HEADER_SIZE + l->ram_length + l->rtc_length +
+          GB_SAVE_CRC_SIZE;
+}
+
+/* Fill the header, RAM and RTC blocks of the container `buf` (of
+ * `gb_save_size(l)` bytes). The CRC is computed by `gb_save_seal`. */
+void gb_save_pack(uint8_t *buf, const struct gb_save_layout *l,
+                  const uint8_t *ram, const uint8_t *rtc) {
+     uint8_t *p = buf;
+
+     memcpy(p, GB_SAVE_MAGIC, GB_SAVE_MAGIC_SIZE);
+     p += GB_SAVE_MAGIC_SIZE;
+     p = gb_save_put_u32(p, GB_SAVE_VERSION);
+     p = gb_save_put_u32(p, l->rom_crc);
+     p = gb_save_put_u32(p, l->rom_length);
+     p = gb_save_put_u32(p, l->ram_length);
+     p = gb_save_put_u32(p, l->rtc_length);
+     p = gb_save_put_u32(p, 0);
+
+     if (l->ram_length) {
+          memcpy(p, ram, l->ram_length);
+          p += l->ram_length;
+     }
+     if (l->rtc_length) {
+          memcpy(p, rtc, l->rtc_length);
+     }
+}
+
+/* Set or clear GB_SAVE_FLAG_MAPPED in the header of the container `buf`. The
+ * CRC must be recomputed afterwards. */
+void gb_save_set_mapped(uint8_t *buf, bool mapped) {
+     gb_save_put_u32(buf + 28, mapped ? GB_SAVE_FLAG_MAPPED : 0);
+}
+
+/* Compute the CRC of the container `buf` */
+void gb_save_seal(uint8_t *buf, const struct gb_save_layout *l) {
+     size_t len = gb_save_size(l) - GB_SAVE_CRC_SIZE;
+
+     gb_save_put_u32(buf + len, gb_crc32c(0, buf, len));
+}
+
+/* Read `len` bytes from `fd` into `data`, handling partial reads. Returns the
+ * number of bytes read (less than `len` at the end of the file) or -1 on
+ * error. */
+static ssize_t gb_save_read_all(int fd, uint8_t *data, size_t len) {
+     size_t total = 0;
+
+     while (total < len) {
+          ssize_t n = read(fd, data + total, len - total);
+
+          if (n < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               return -1;
+          }
+
+          if (n == 0) {
+               break;
+          }
+
+          total += n;
+     }
+
+     return total;
+}
+
+/* Validate the container `buf` of `len` bytes against the layout `l` and copy
+ * its contents to `ram` and `rtc`. Nothing is copied if it's invalid. */
+static enum gb_save_status gb_save_unpack(const char *path,
+                                          const uint8_t *buf, size_t len,
+                                          const struct gb_save_layout *l,
+                                          uint8_t *ram, uint8_t *rtc,
+                                          bool *rtc_loaded) {
+     struct gb_save_layout file;
+     uint32_t version;
+     uint32_t flags;
+     size_t data_len;
+
+     if (len < GB_SAVE_HEADER_SIZE + GB_SAVE_CRC_SIZE) {
+          fprintf(stderr, "Save file '%s' is truncated\n", path);
+          return GB_SAVE_INVALID;
+     }
+
+     version = gb_save_get_u32(buf + 8);
+     if (version != GB_SAVE_VERSION) {
+          fprintf(stderr, "Save file '%s' has unsupported version %u\n",
+                  path, version);
+          return GB_SAVE_INVALID;
+     }
+
+     file.rom_crc = gb_save_get_u32(buf + 12);
+     file.rom_length = gb_save_get_u32(buf + 16);
+     file.ram_length = gb_save_get_u32(buf + 20);
+     file.rtc_length = gb_save_get_u32(buf + 24);
+     flags = gb_save_get_u32(buf + 28);
+
+     if (file.ram_length > GB_SAVE_MAX_FILE_SIZE ||
+         file.rtc_length > GB_SAVE_MAX_FILE_SIZE ||
+         gb_save_size(&file) != len) {
+          fprintf(stderr, "Save file '%s' is truncated\n", path);
+          return GB_SAVE_INVALID;
+     }
+
+     data_len = len - GB_SAVE_CRC_SIZE;
+     if (gb_crc32c(0, buf, data_len) != gb_save_get_u32(buf + data_len)) {
+          if (!(flags & GB_SAVE_FLAG_MAPPED)) {
+               fprintf(stderr, "Save file '%s' is corrupt (bad checksum)\n",
+                       path);
+               return GB_SAVE_INVALID;
+          }
+
+          /* The game writes to mapped saves directly and the CRC is only
+           * updated when the RAM is flushed, a crash in between is expected
+           * to leave a stale CRC. Rejecting the file would lose the save. */
+          fprintf(stderr, "Warning: save file '%s' wasn't closed cleanly, "
+                  "its checksum can't be verified\n", path);
+     }
+
+     if (file.ram_length != l->ram_length ||
+         file.rtc_length != l->rtc_length) {
+          fprintf(stderr,
+                  "Save file '%s' doesn't match this cartridge "
+                  "(%zu bytes of RAM and %zu bytes of RTC state instead of "
+                  "%zu and %zu)\n",
+                  path, file.ram_length, file.rtc_length,
+                  l->ram_length, l->rtc_length);
+          return GB_SAVE_INVALID;
+     }
+
+     if (file.rom_crc != l->rom_crc || file.rom_length != l->rom_length) {
+          /* Probably a patched or different revision of the same game, the
+           * layout matches so we can still use it */
+          fprintf(stderr, "Warning: save file '%s' was made with a different "
+                  "ROM\n", path);
+     }
+
+     buf += GB_SAVE_HEADER_SIZE;
+     if (l->ram_length) {
+          memcpy(ram, buf, l->ram_length);
+          buf += l->ram_length;
+     }
+     if (l->rtc_length) {
+          memcpy(rtc, buf, l->rtc_length);
+          *rtc_loaded = true;
+     }
+
+     return GB_SAVE_CONTAINER;
+}
+
+/* Import the raw save `buf` of `len` bytes: the RAM contents, optionally
+ * followed by the RTC state */
+static enum gb_save_status gb_save_import_raw(const char *path,
+                                              const uint8_t *buf, size_t len,
+                                              const struct gb_save_layout *l,
+                                              uint8_t *ram, uint8_t *rtc,
+                                              bool *rtc_loaded) {
+     if (len < l->ram_length) {
+          fprintf(stderr, "RAM save file '%s' is too small!\n", path);
+          return GB_SAVE_INVALID;
+     }
+
+     if (l->ram_length) {
+          memcpy(ram, buf, l->ram_length);
+     }
+
+     if (l->rtc_length) {
+          /* Other emulators append their RTC state in different formats,
+           * only an exact match can be our own */
+          if (len == l->ram_length + l->rtc_length) {
+               memcpy(rtc, buf + l->ram_length, l->rtc_length);
+               *rtc_loaded = true;
+          } else {
+               fprintf(stderr, "No RTC state in '%s', the clock starts "
+                       "over\n", path);
+          }
+     }
+
+     return GB_SAVE_RAW;
+}
+
+/* Load the save file at `path` in a single read and validate it before
+ * copying its contents to `ram` (`l->ram_length` bytes) and `rtc`
+ * (`l->rtc_length` bytes). `*rtc_loaded` is set to true if `rtc` has been
+ * filled. The buffers are left untouched unless the file is valid. */
+enum gb_save_status gb_save_read(const char *path,
+                                 const struct gb_save_layout *l,
+                                 uint8_t *ram, uint8_t *rtc,
+                                 bool *rtc_loaded) {
+     enum gb_save_status status;
+     struct stat st;
+     uint8_t *buf;
+     ssize_t len;
+     int fd;
+
+     *rtc_loaded = false;
+
+     fd = open(path, O_RDONLY);
+     if (fd < 0) {
+          if (errno == ENOENT) {
+               return GB_SAVE_MISSING;
+          }
+          fprintf(stderr, "Can't open save file '%s': %s\n",
+                  path, strerror(errno));
+          return GB_SAVE_INVALID;
+     }
+
+     if (fstat(fd, &st) < 0) {
+          perror("Can't stat save file");
+          close(fd);
+          return GB_SAVE_INVALID;
+     }
+
+     if (st.st_size > GB_SAVE_MAX_FILE_SIZE) {
+          fprintf(stderr, "Save file '%s' is too big\n", path);
+          close(fd);
+          return GB_SAVE_INVALID;
+     }
+
+     /* One byte more than expected so that we notice if the file grew */
+     buf = malloc(st.st_size + 1);
+     if (buf == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     len = gb_save_read_all(fd, buf, st.st_size + 1);
+     close(fd);
+     if (len < 0) {
+          fprintf(stderr, "Can't read save file '%s': %s\n",
+                  path, strerror(errno));
+          free(buf);
+          return GB_SAVE_INVALID;
+     }
+
+     if (len >= GB_SAVE_MAGIC_SIZE &&
+         memcmp(buf, GB_SAVE_MAGIC, GB_SAVE_MAGIC_SIZE) == 0) {
+          status = gb_save_unpack(path, buf, len, l, ram, rtc, rtc_loaded);
+     } else {
+          status = gb_save_import_raw(path, buf, len, l, ram, rtc, rtc_loaded);
+     }
+
+     free(buf);
+
+     return status;
+}
+
+/* Write `len` bytes of `data` to `fd`, handling partial writes */
+static int gb_save_write_all(int fd, const uint8_t *data, size_t len) {
+     while (len) {
+          ssize_t n = write(fd, data, len);
+
+          if (n < 0) {
+               if (errno == EINTR) {
+                    continue;
+               }
+               return -1;
+          }
+
+          data += n;
+          len -= n;
+     }
+
+     return 0;
+}
+
+/* Sync the directory containing `path` so that the rename is durable */
+static void gb_save_sync_dir(const char *path) {
+     char *copy = strdup(path);
+     int fd;
+
+     if (copy == NULL) {
+          return;
+     }
+
+     fd = open(dirname(copy), O_RDONLY);
+     if (fd >= 0) {
+          fsync(fd);
+          close(fd);
+     }
+
+     free(copy);
+}
+
+/* Returns a newly allocated `<path>.tmp` */
+static char *gb_save_tmp_path(const char *path) {
+     char *tmp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+
+     if (tmp_path == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     strcpy(tmp_path, path);
+     strcat(tmp_path, ".tmp");
+
+     return tmp_path;
+}
+
+/* Write `data` to `tmp_path` and rename it over `path`. Returns 0 on
+ * success, -1 on error. */
+static int gb_save_replace(const char *path, const char *tmp_path,
+                           const uint8_t *data, size_t len) {
+     int fd;
+
+     fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     if (fd < 0) {
+          fprintf(stderr, "Can't create or open save file '%s': %s\n",
+                  tmp_path, strerror(errno));
+          return -1;
+     }
+
+     if (gb_save_write_all(fd, data, len) < 0 || fsync(fd) < 0) {
+          fprintf(stderr, "Can't write save file '%s': %s\n",
+                  tmp_path, strerror(errno));
+          close(fd);
+          unlink(tmp_path);
+          return -1;
+     }
+
+     close(fd);
+
+     /* Atomically replace the previous save */
+     if (rename(tmp_path, path) < 0) {
+          fprintf(stderr, "Can't rename '%s' to '%s': %s\n",
+                  tmp_path, path, strerror(errno));
+          unlink(tmp_path);
+          return -1;
+     }
+
+     gb_save_sync_dir(path);
+
+     return 0;
+}
+
+/* Atomically replace the file at `path` with `data`, from the calling
+ * thread. Returns 0 on success, -1 on error. */
+int gb_save_write_file(const char *path, const uint8_t *data, size_t len) {
+     char *tmp_path = gb_save_tmp_path(path);
+     int ret = gb_save_replace(path, tmp_path, data, len);
+
+     free(tmp_path);
+
+     return ret;
+}
+
+static void gb_save_write(struct gb_save_writer *w,
+                          struct gb_save_snapshot *s) {
+     /* The checksum is computed here rather than in the emulation thread */
+     gb_save_seal(s->data, &w->layout);
+
+     if (gb_save_replace(w->path, w->tmp_path, s->data, s->len) == 0) {
+          printf("Saved RAM\n");
+     }
+}
+
+static void *gb_save_thread(void *arg) {
+     struct gb_save_writer *w = arg;
+     bool quit = false;
+
+     while (!quit) {
+          struct gb_save_snapshot *s;
+
+          sem_wait(&w->ready);
+
+          pthread_mutex_lock(&w->lock);
+          s = w->pending;
+          w->pending = NULL;
+          quit = w->quit;
+          pthread_mutex_unlock(&w->lock);
+
+          if (s) {
+               gb_save_write(w, s);
+               free(s);
+          }
+     }
+
+     return NULL;
+}
+
+void gb_save_writer_start(struct gb_save_writer *w, const char *path,
+                          const struct gb_save_layout *l) {
+     w->path = strdup(path);
+     if (w->path == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     w->tmp_path = gb_save_tmp_path(path);
+     w->layout = *l;
+     w->pending = NULL;
+     w->quit = false;
+
+     pthread_mutex_init(&w->lock, NULL);
+     sem_init(&w->ready, 0, 0);
+
+     if (pthread_create(&w->thread, NULL, gb_save_thread, w)) {
+          perror("Can't create save thread");
+          die();
+     }
+}
+
+/* Snapshot the save data (the RAM and RTC state of the writer's layout) and
+ * queue it for writing. Only copies the data, the file is written in the
+ * background. */
+void gb_save_writer_queue(struct gb_save_writer *w,
+                          const uint8_t *ram, const uint8_t *rtc) {
+     struct gb_save_snapshot *s;
+     struct gb_save_snapshot *old;
+     size_t len = gb_save_size(&w->layout);
+
+     s = malloc(sizeof(*s) + len);
+     if (s == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     s->len = len;
+     gb_save_pack(s->data, &w->layout, ram, rtc);
+
+     pthread_mutex_lock(&w->lock);
+     old = w->pending;
+     w->pending = s;
+     pthread_mutex_unlock(&w->lock);
+
+     if (old) {
+          /* The writer hasn't picked up the previous snapshot yet, it's now
+           * obsolete. The thread has already been woken up for it. */
+          free(old);
+     } else {
+          sem_post(&w->ready);
+     }
+}
+
+/* Write the pending snapshot (if any) and stop the writer thread */
+void gb_save_writer_stop(struct gb_save_writer *w) {
+     pthread_mutex_lock(&w->lock);
+     w->quit = true;
+     pthread_mutex_unlock(&w->lock);
+
+     sem_post(&w->ready);
+     pthread_join(w->thread, NULL);
+
+     pthread_mutex_destroy(&w->lock);
+     sem_destroy(&w->ready);
+
+     free(w->path);
+     free(w->tmp_path);
+     w->path = NULL;
+     w->tmp_path = NULL;
+}
@@ -0,0 +1,96 @@
+#ifndef _GB_SAVE_H_
+#define _GB_SAVE_H_
+
+/* Battery saves are stored in a small container so that a truncated or
+ * corrupt file (or the save of another game) is detected before it's used:
+ *
+ *   0   magic, GB_SAVE_MAGIC
+ *   8   container version, GB_SAVE_VERSION
+ *   12  CRC32C of the ROM
+ *   16  ROM length
+ *   20  RAM length
+ *   24  RTC state length (0 or GB_RTC_DUMP_SIZE)
+ *   28  flags, GB_SAVE_FLAG_*
+ *   32  RAM contents
+ *       RTC state, in the format of `gb_rtc_dump`
+ *       CRC32C of everything above
+ *
+ * All the integers are 32bit big endian, like the RTC state. Files which
+ * don't start with the magic are imported as raw saves: the RAM contents,
+ * optionally followed by the RTC state. That's what older versions of the
+ * emulator wrote and what most other emulators use for the RAM. */
+#define GB_SAVE_MAGIC        "GBSAVE\r\n"
+#define GB_SAVE_MAGIC_SIZE   8
+#define GB_SAVE_VERSION      1
+#define GB_SAVE_HEADER_SIZE  32
+#define GB_SAVE_CRC_SIZE     4
+/* The file is mapped in memory (`-m`) and the RAM is modified in place, so
+ * the CRC may be behind if the emulator didn't exit cleanly. Such a file is
+ * loaded with a warning if the CRC doesn't match, instead of being rejected. */
+#define GB_SAVE_FLAG_MAPPED  1U
+/* Files bigger than this can't be a save */
+#define GB_SAVE_MAX_FILE_SIZE (1024 * 1024)
+
+/* What the save file of a cartridge is expected to contain */
+struct gb_save_layout {
+     uint32_t rom_crc;
+     uint32_t rom_length;
+     size_t ram_length;
+     size_t rtc_length;
+};
+
+enum gb_save_status {
+     /* The file exists but can't be used */
+     GB_SAVE_INVALID = -1,
+     /* There's no save file yet */
+     GB_SAVE_MISSING,
+     /* Raw save, imported */
+     GB_SAVE_RAW,
+     /* Valid container */
+     GB_SAVE_CONTAINER,
+};
+
+struct gb_save_snapshot;
+
+/* Writes the battery-backed save file in a background thread so that the
+ * emulation never waits for the disk. The file is replaced atomically: the
+ * data is written to a temporary file which is synced and then renamed over
+ * the previous save, so a crash can't leave a truncated save behind. */
+struct gb_save_writer {
+     /* Path of the save file */
+     char *path;
+     /* Path of the temporary file */
+     char *tmp_path;
+     /* Layout of the saves */
+     struct gb_save_layout layout;
+     pthread_t thread;
+     /* Protects `pending` and `quit` */
+     pthread_mutex_t lock;
+     /* Posted when a snapshot becomes pending or when we want to quit */
+     sem_t ready;
+     /* Next snapshot to be written, if any. Only the latest snapshot matters
+      * so if a new one is queued before the writer gets to this one it
+      * replaces it. */
+     struct gb_save_snapshot *pending;
+     /* Set to make the thread quit once `pending` has been written */
+     bool quit;
+};
+
+size_t gb_save_size(const struct gb_save_layout *l);
+void gb_save_pack(uint8_t *buf, const struct gb_save_layout *l,
+                  const uint8_t *ram, const uint8_t *rtc);
+void gb_save_seal(uint8_t *buf, const struct gb_save_layout *l);
+void gb_save_set_mapped(uint8_t *buf, bool mapped);
+enum gb_save_status gb_save_read(const char *path,
+                                 const struct gb_save_layout *l,
+                                 uint8_t *ram, uint8_t *rtc,
+                                 bool *rtc_loaded);
+int gb_save_write_file(const char *path, const uint8_t *data, size_t len);
+
+void gb_save_writer_start(struct gb_save_writer *w, const char *path,
+                          const struct gb_save_layout *l);
+void gb_save_writer_queue(struct gb_save_writer *w,
+                          const uint8_t *ram, const uint8_t *rtc);
+void gb_save_writer_stop(struct gb_save_writer *w);
+
+#endif /* _GB_SAVE_H_ */
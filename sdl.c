@@ -1,7 +1,11 @@
 #include <SDL.h>
-#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "gb.h"
+#include "sdl.h"
 
+/* Size of the window relative to the native resolution */
 #define UPSCALE_FACTOR 4
 
 struct gb_sdl_context {
@@ -11,75 +15,23 @@ struct gb_sdl_context {
      SDL_GameController *controller;
      SDL_AudioSpec audio_spec;
      SDL_AudioDeviceID audio_device;
-     uint32_t pixels[GB_LCD_WIDTH * GB_LCD_HEIGHT * UPSCALE_FACTOR * UPSCALE_FACTOR];
-     /* Index of the next audio buffer we want to play */
-     unsigned audio_buf_index;
+     /* Upscaling factor applied on the CPU before the frame is sent to the
+      * canvas. If it's 1 the upscaling is left to SDL's renderer. */
+     unsigned cpu_scale;
+     /* If true use the Scale2x algorithm instead of plain pixel
+      * duplication (only with `cpu_scale` == 2) */
+     bool scale2x;
+     /* True if the GPU renders directly into the locked canvas. Only possible
+      * if `cpu_scale` is 1 and nobody reads the frame buffer back, since the
+      * memory of a locked texture is write-only. */
+     bool direct;
+     /* Native resolution frame the GPU renders into if `direct` is false,
+      * NULL otherwise */
+     uint32_t *frame;
+     /* Value of SDL_GetTicks() the last time we polled the events */
+     Uint32 last_poll;
 };
 
-static void gb_sdl_draw_line_dmg(struct gb *gb, unsigned ly,
-                                 union gb_gpu_color line[GB_LCD_WIDTH]) {
-     struct gb_sdl_context *ctx = gb->frontend.data;
-     unsigned i;
-     unsigned x;
-     unsigned y;
-
-     static const uint32_t col_map[4] = {
-          [GB_COL_WHITE]     = 0xff75a32c,
-          [GB_COL_LIGHTGREY] = 0xff387a21,
-          [GB_COL_DARKGREY]  = 0xff255116,
-          [GB_COL_BLACK]     = 0xff12280b,
-     };
-
-     for (i = 0; i < GB_LCD_WIDTH; i++) {
-          for (y = 0; y < UPSCALE_FACTOR; y++) {
-               for (x = 0; x < UPSCALE_FACTOR; x++) {
-                    ctx->pixels[(ly + y) * GB_LCD_WIDTH * UPSCALE_FACTOR + i + x] = col_map[line[i].dmg_color];
-               }
-          }
-     }
-}
-
-static uint32_t gb_sdl_5_to_8bits(uint32_t v) {
-     return (v << 3) | (v >> 2);
-}
-
-static uint32_t gb_sdl_gbc_to_xrgb8888(uint16_t c) {
-     uint32_t r = c & 0x1f;
-     uint32_t g = (c >> 5) & 0x1f;
-     uint32_t b = (c >> 10) & 0x1f;
-     uint32_t p;
-
-     /* Extend from 5 to 8 bits */
-     r = gb_sdl_5_to_8bits(r);
-     g = gb_sdl_5_to_8bits(g);
-     b = gb_sdl_5_to_8bits(b);
-
-     p = 0xff000000;
-     p |= r << 16;
-     p |= g << 8;
-     p |= b;
-
-     return p;
-}
-
-static void gb_sdl_draw_line_gbc(struct gb *gb, unsigned ly,
-                                 union gb_gpu_color line[GB_LCD_WIDTH]) {
-     struct gb_sdl_context *ctx = gb->frontend.data;
-     unsigned i;
-     unsigned x;
-     unsigned y;
-
-     for (i = 0; i < GB_LCD_WIDTH; i++) {
-          uint16_t c = line[i].gbc_color;
-
-          for (y = 0; y < UPSCALE_FACTOR; y++) {
-               for (x = 0; x < UPSCALE_FACTOR; x++) {
-                    ctx->pixels[(ly + y) * GB_LCD_WIDTH * UPSCALE_FACTOR + i + x] = gb_sdl_gbc_to_xrgb8888(c);
-               }
-          }
-     }
-}
-
 static void gb_sdl_handle_key(struct gb *gb, SDL_Keycode key, bool pressed) {
      switch (key) {
      case SDLK_q:
@@ -89,28 +41,28 @@ static void gb_sdl_handle_key(struct gb *gb, SDL_Keycode key, bool pressed) {
           }
           break;
      case SDLK_RETURN:
-          gb_input_set(gb, GB_INPUT_START, pressed);
+          gb_input_push(gb, GB_INPUT_START, pressed);
           break;
      case SDLK_RSHIFT:
-          gb_input_set(gb, GB_INPUT_SELECT, pressed);
+          gb_input_push(gb, GB_INPUT_SELECT, pressed);
           break;
      case SDLK_LCTRL:
-          gb_input_set(gb, GB_INPUT_A, pressed);
+          gb_input_push(gb, GB_INPUT_A, pressed);
           break;
      case SDLK_LSHIFT:
-          gb_input_set(gb, GB_INPUT_B, pressed);
+          gb_input_push(gb, GB_INPUT_B, pressed);
           break;
      case SDLK_UP:
-          gb_input_set(gb, GB_INPUT_UP, pressed);
+          gb_input_push(gb, GB_INPUT_UP, pressed);
           break;
      case SDLK_DOWN:
-          gb_input_set(gb, GB_INPUT_DOWN, pressed);
+          gb_input_push(gb, GB_INPUT_DOWN, pressed);
           break;
      case SDLK_LEFT:
-          gb_input_set(gb, GB_INPUT_LEFT, pressed);
+          gb_input_push(gb, GB_INPUT_LEFT, pressed);
           break;
      case SDLK_RIGHT:
-          gb_input_set(gb, GB_INPUT_RIGHT, pressed);
+          gb_input_push(gb, GB_INPUT_RIGHT, pressed);
           break;
      }
 }
@@ -119,28 +71,28 @@ static void gb_sdl_handle_button(struct gb *gb, unsigned button, bool pressed) {
      /* A and B are swapped between the GB and SDL (XBox) conventions */
      switch (button) {
      case SDL_CONTROLLER_BUTTON_START:
-          gb_input_set(gb, GB_INPUT_START, pressed);
+          gb_input_push(gb, GB_INPUT_START, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_BACK:
-          gb_input_set(gb, GB_INPUT_SELECT, pressed);
+          gb_input_push(gb, GB_INPUT_SELECT, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_B:
-          gb_input_set(gb, GB_INPUT_A, pressed);
+          gb_input_push(gb, GB_INPUT_A, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_A:
-          gb_input_set(gb, GB_INPUT_B, pressed);
+          gb_input_push(gb, GB_INPUT_B, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_DPAD_UP:
-          gb_input_set(gb, GB_INPUT_UP, pressed);
+          gb_input_push(gb, GB_INPUT_UP, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_DPAD_DOWN:
-          gb_input_set(gb, GB_INPUT_DOWN, pressed);
+          gb_input_push(gb, GB_INPUT_DOWN, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_DPAD_LEFT:
-          gb_input_set(gb, GB_INPUT_LEFT, pressed);
+          gb_input_push(gb, GB_INPUT_LEFT, pressed);
           break;
      case SDL_CONTROLLER_BUTTON_DPAD_RIGHT:
-          gb_input_set(gb, GB_INPUT_RIGHT, pressed);
+          gb_input_push(gb, GB_INPUT_RIGHT, pressed);
           break;
      }
 }
@@ -201,9 +153,14 @@ static void gb_sdl_handle_controller_removed(struct gb *gb, Sint32 which) {
      }
 }
 
-static void gb_sdl_refresh_input(struct gb *gb) {
+/* Process the pending SDL events. The button events are pushed to the
+ * emulator's input queue. */
+static void gb_sdl_poll_events(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
      SDL_Event e;
 
+     ctx->last_poll = SDL_GetTicks();
+
      while(SDL_PollEvent(&e)) {
           switch (e.type) {
           case SDL_QUIT:
@@ -229,16 +186,227 @@ static void gb_sdl_refresh_input(struct gb *gb) {
      }
 }
 
+/* Normally the events are polled once per frame in `gb_sdl_flip`, right
+ * before the game reads the input during VBLANK. This is only a fallback for
+ * when no frame is displayed, for instance while the LCD is off. */
+static void gb_sdl_refresh_input(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+
+     if (SDL_GetTicks() - ctx->last_poll >= 50) {
+          gb_sdl_poll_events(gb);
+     }
+}
+
+/* Duplicate each pixel of `src` `factor` times horizontally */
+static void gb_sdl_scale_line(const uint32_t *src, uint32_t *dst,
+                              unsigned factor) {
+     unsigned x = 0;
+
+#ifdef __SSE2__
+     /* GB_LCD_WIDTH is a multiple of 4 so we can process the entire line 4
+      * pixels at a time */
+     for (; x < GB_LCD_WIDTH; x += 4) {
+          __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+          __m128i *d = (__m128i *)(dst + x * factor);
+
+          switch (factor) {
+          case 2:
+               _mm_storeu_si128(d + 0, _mm_unpacklo_epi32(v, v));
+               _mm_storeu_si128(d + 1, _mm_unpackhi_epi32(v, v));
+               break;
+          case 3:
+               _mm_storeu_si128(d + 0, _mm_shuffle_epi32(v, 0x40));
+               _mm_storeu_si128(d + 1, _mm_shuffle_epi32(v, 0xa5));
+               _mm_storeu_si128(d + 2, _mm_shuffle_epi32(v, 0xfe));
+               break;
+          case 4:
+               _mm_storeu_si128(d + 0, _mm_shuffle_epi32(v, 0x00));
+               _mm_storeu_si128(d + 1, _mm_shuffle_epi32(v, 0x55));
+               _mm_storeu_si128(d + 2, _mm_shuffle_epi32(v, 0xaa));
+               _mm_storeu_si128(d + 3, _mm_shuffle_epi32(v, 0xff));
+               break;
+          }
+     }
+#endif
+
+     for (; x < GB_LCD_WIDTH; x++) {
+          unsigned i;
+
+          for (i = 0; i < factor; i++) {
+               dst[x * factor + i] = src[x];
+          }
+     }
+}
+
+/* Upscale `src` by duplicating every pixel `factor` times in both directions.
+ * `pitch` is the length of a line of `dst` in bytes. */
+static void gb_sdl_scale_nearest(const uint32_t *src, uint8_t *dst,
+                                 int pitch, unsigned factor) {
+     const size_t line_len = GB_LCD_WIDTH * factor * sizeof(uint32_t);
+     unsigned y;
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          uint8_t *first = dst + y * factor * pitch;
+          unsigned i;
+
+          gb_sdl_scale_line(src + y * GB_LCD_WIDTH, (uint32_t *)first, factor);
+
+          /* The other lines are identical */
+          for (i = 1; i < factor; i++) {
+               memcpy(first + i * pitch, first, line_len);
+          }
+     }
+}
+
+/* Upscale `src` by a factor of 2 using the Scale2x algorithm: each pixel E is
+ * replaced by 4 pixels E0-E3 depending on its neighbours B (above), D (left),
+ * F (right) and H (below):
+ *
+ *   E0 = (D == B && B != H && D != F) ? D : E
+ *   E1 = (B == F && B != H && D != F) ? F : E
+ *   E2 = (D == H && B != H && D != F) ? D : E
+ *   E3 = (H == F && B != H && D != F) ? F : E
+ *
+ * Pixels outside of the screen are replaced by the closest edge pixel. */
+static void gb_sdl_scale2x(const uint32_t *src, uint8_t *dst, int pitch) {
+     /* Current line with one extra pixel on each side */
+     uint32_t line[GB_LCD_WIDTH + 2];
+     unsigned y;
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          const uint32_t *e = src + y * GB_LCD_WIDTH;
+          const uint32_t *b = (y > 0) ? e - GB_LCD_WIDTH : e;
+          const uint32_t *h = (y < GB_LCD_HEIGHT - 1) ? e + GB_LCD_WIDTH : e;
+          uint32_t *top = (uint32_t *)(dst + y * 2 * pitch);
+          uint32_t *bottom = (uint32_t *)(dst + (y * 2 + 1) * pitch);
+          unsigned x = 0;
+
+          memcpy(line + 1, e, GB_LCD_WIDTH * sizeof(uint32_t));
+          line[0] = e[0];
+          line[GB_LCD_WIDTH + 1] = e[GB_LCD_WIDTH - 1];
+
+#ifdef __SSE2__
+          for (; x < GB_LCD_WIDTH; x += 4) {
+               __m128i ve = _mm_loadu_si128((const __m128i *)(line + x + 1));
+               __m128i vd = _mm_loadu_si128((const __m128i *)(line + x));
+               __m128i vf = _mm_loadu_si128((const __m128i *)(line + x + 2));
+               __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+               __m128i vh = _mm_loadu_si128((const __m128i *)(h + x));
+               __m128i same;
+               __m128i m0, m1, m2, m3;
+               __m128i e0, e1, e2, e3;
+
+               /* All bits set in the lanes where B == H or D == F, in which
+                * case the pixel is left unchanged */
+               same = _mm_or_si128(_mm_cmpeq_epi32(vb, vh),
+                                   _mm_cmpeq_epi32(vd, vf));
+
+               m0 = _mm_andnot_si128(same, _mm_cmpeq_epi32(vd, vb));
+               m1 = _mm_andnot_si128(same, _mm_cmpeq_epi32(vb, vf));
+               m2 = _mm_andnot_si128(same, _mm_cmpeq_epi32(vd, vh));
+               m3 = _mm_andnot_si128(same, _mm_cmpeq_epi32(vh, vf));
+
+               e0 = _mm_or_si128(_mm_and_si128(m0, vd),
+                                 _mm_andnot_si128(m0, ve));
+               e1 = _mm_or_si128(_mm_and_si128(m1, vf),
+                                 _mm_andnot_si128(m1, ve));
+               e2 = _mm_or_si128(_mm_and_si128(m2, vd),
+                                 _mm_andnot_si128(m2, ve));
+               e3 = _mm_or_si128(_mm_and_si128(m3, vf),
+                                 _mm_andnot_si128(m3, ve));
+
+               /* Interleave the left and right output pixels */
+               _mm_storeu_si128((__m128i *)(top + x * 2),
+                                _mm_unpacklo_epi32(e0, e1));
+               _mm_storeu_si128((__m128i *)(top + x * 2 + 4),
+                                _mm_unpackhi_epi32(e0, e1));
+               _mm_storeu_si128((__m128i *)(bottom + x * 2),
+                                _mm_unpacklo_epi32(e2, e3));
+               _mm_storeu_si128((__m128i *)(bottom + x * 2 + 4),
+                                _mm_unpackhi_epi32(e2, e3));
+          }
+#endif
+
+          for (; x < GB_LCD_WIDTH; x++) {
+               uint32_t pe = line[x + 1];
+               uint32_t pd = line[x];
+               uint32_t pf = line[x + 2];
+               uint32_t pb = b[x];
+               uint32_t ph = h[x];
+
+               if (pb != ph && pd != pf) {
+                    top[x * 2]        = (pd == pb) ? pd : pe;
+                    top[x * 2 + 1]    = (pb == pf) ? pf : pe;
+                    bottom[x * 2]     = (pd == ph) ? pd : pe;
+                    bottom[x * 2 + 1] = (ph == pf) ? pf : pe;
+               } else {
+                    top[x * 2]        = pe;
+                    top[x * 2 + 1]    = pe;
+                    bottom[x * 2]     = pe;
+                    bottom[x * 2 + 1] = pe;
+               }
+          }
+     }
+}
+
+/* Lock the canvas and, if we render directly into it, point the frame buffer
+ * at it */
+static void gb_sdl_lock_canvas(struct gb *gb, void **pixels, int *pitch) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+
+     if (SDL_LockTexture(ctx->canvas, NULL, pixels, pitch) < 0) {
+          fprintf(stderr, "SDL_LockTexture failed: %s\n", SDL_GetError());
+          die();
+     }
+
+     if (ctx->direct) {
+          gb->frontend.fb.pixels = *pixels;
+          gb->frontend.fb.pitch = *pitch;
+     }
+}
+
+/* Copy the native resolution `src` to `dst`. `pitch` is the length of a line
+ * of `dst` in bytes. */
+static void gb_sdl_copy_frame(const uint32_t *src, uint8_t *dst, int pitch) {
+     unsigned y;
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          memcpy(dst + y * pitch, src + y * GB_LCD_WIDTH,
+                 GB_LCD_WIDTH * sizeof(*src));
+     }
+}
+
 static void gb_sdl_flip(struct gb *gb) {
      struct gb_sdl_context *ctx = gb->frontend.data;
+     void *pixels;
+     int pitch;
+
+     if (!ctx->direct) {
+          /* Copy or upscale the frame into the canvas */
+          gb_sdl_lock_canvas(gb, &pixels, &pitch);
+
+          if (ctx->cpu_scale == 1) {
+               gb_sdl_copy_frame(ctx->frame, pixels, pitch);
+          } else if (ctx->scale2x) {
+               gb_sdl_scale2x(ctx->frame, pixels, pitch);
+          } else {
+               gb_sdl_scale_nearest(ctx->frame, pixels, pitch, ctx->cpu_scale);
+          }
+     }
 
-     /* Copy pixels to the canvas texture */
-     SDL_UpdateTexture(ctx->canvas, NULL, ctx->pixels,
-                       GB_LCD_WIDTH * UPSCALE_FACTOR * sizeof(ctx->pixels[0]));
+     /* Upload the canvas */
+     SDL_UnlockTexture(ctx->canvas);
 
      /* Render the canvas */
      SDL_RenderCopy(ctx->renderer, ctx->canvas, NULL, NULL);
      SDL_RenderPresent(ctx->renderer);
+
+     if (ctx->direct) {
+          /* Lock the canvas again for the next frame */
+          gb_sdl_lock_canvas(gb, &pixels, &pitch);
+     }
+
+     gb_sdl_poll_events(gb);
 }
 
 static void gb_sdl_destroy(struct gb *gb) {
@@ -248,7 +416,12 @@ static void gb_sdl_destroy(struct gb *gb) {
           SDL_GameControllerClose(ctx->controller);
      }
 
+     if (ctx->direct) {
+          SDL_UnlockTexture(ctx->canvas);
+     }
+
      SDL_DestroyTexture(ctx->canvas);
+     free(ctx->frame);
      SDL_DestroyRenderer(ctx->renderer);
      SDL_DestroyWindow(ctx->window);
      SDL_Quit();
@@ -260,32 +433,36 @@ static void gb_sdl_audio_callback(void *userdata,
                                   Uint8 *stream,
                                   int len) {
      struct gb *gb = userdata;
-     struct gb_sdl_context *ctx = gb->frontend.data;
-     struct gb_spu_sample_buffer *buf = &gb->spu.buffers[ctx->audio_buf_index];
+     int16_t (*out)[2] = (void *)stream;
+     unsigned frames = len / sizeof(*out);
+     unsigned n;
 
-     /* Normally the frontend should always request exactly the correct length
-      */
-     assert(len == sizeof(buf->samples));
+     n = gb_spu_ring_read(&gb->spu.ring, out, frames);
 
-     if (sem_trywait(&buf->ready) == 0) {
-          /* Buffer is ready */
-          memcpy(stream, buf->samples, sizeof(buf->samples));
-
-          /* Tell the SPU that it can refill this buffer */
-          sem_post(&buf->free);
-          /* Move on to the next buffer */
-          ctx->audio_buf_index = (ctx->audio_buf_index + 1)
-               % GB_SPU_SAMPLE_BUFFER_COUNT;
-     } else {
-          /* Buffer is not ready yet, we're running slow! */
-          fprintf(stderr, "Emulator is running too slow!\n");
-          memset(stream, 0, sizeof(buf->samples));
-     }
+     /* If we're running slow pad with silence, the ring keeps track of the
+      * underruns */
+     memset(out + n, 0, (frames - n) * sizeof(*out));
 }
 
-void gb_sdl_frontend_init(struct gb *gb) {
+/* Set `read_back` if the frame buffer is read after it's been drawn (hash log,
+ * video capture) */
+void gb_sdl_frontend_init(struct gb *gb, unsigned cpu_scale, bool scale2x,
+                          bool vsync, bool read_back) {
      struct gb_sdl_context *ctx;
      SDL_AudioSpec want;
+     void *pixels;
+     int pitch;
+     unsigned y;
+
+     if (cpu_scale < 1 || cpu_scale > 4) {
+          fprintf(stderr, "Unsupported upscaling factor %u\n", cpu_scale);
+          die();
+     }
+
+     if (scale2x && cpu_scale != 2) {
+          fprintf(stderr, "Scale2x only supports upscaling by a factor 2\n");
+          die();
+     }
 
      ctx = malloc(sizeof(*ctx));
      if (ctx == NULL) {
@@ -295,62 +472,104 @@ void gb_sdl_frontend_init(struct gb *gb) {
 
      gb->frontend.data = ctx;
 
-     ctx->audio_buf_index = 0;
+     ctx->cpu_scale = cpu_scale;
+     ctx->scale2x = scale2x;
+     ctx->direct = cpu_scale == 1 && !read_back;
+     ctx->frame = NULL;
+     ctx->controller = NULL;
+     ctx->last_poll = 0;
 
      if (SDL_Init(SDL_INIT_VIDEO |
                   SDL_INIT_GAMECONTROLLER |
-                  SDL_INIT_AUDIO) < 0) {
+                  (gb->spu.output_enabled ? SDL_INIT_AUDIO : 0)) < 0) {
           fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
           die();
      }
 
-     if (SDL_CreateWindowAndRenderer(GB_LCD_WIDTH * UPSCALE_FACTOR, GB_LCD_HEIGHT * UPSCALE_FACTOR,
-                                     0, &ctx->window, &ctx->renderer) < 0) {
-          fprintf(stderr, "SDL_CreateWindowAndRenderer failed: %s\n",
-                  SDL_GetError());
+     ctx->window = SDL_CreateWindow("Gaembuoy",
+                                    SDL_WINDOWPOS_UNDEFINED,
+                                    SDL_WINDOWPOS_UNDEFINED,
+                                    GB_LCD_WIDTH * UPSCALE_FACTOR,
+                                    GB_LCD_HEIGHT * UPSCALE_FACTOR,
+                                    0);
+     if (ctx->window == NULL) {
+          fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError());
           die();
      }
 
-     SDL_SetWindowTitle(ctx->window, "Gaembuoy");
+     /* With vsync SDL_RenderPresent blocks until the next refresh, which paces
+      * the emulation to the display's refresh rate */
+     ctx->renderer = SDL_CreateRenderer(ctx->window, -1,
+                                        vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+     if (ctx->renderer == NULL) {
+          fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError());
+          die();
+     }
 
      ctx->canvas = SDL_CreateTexture(ctx->renderer,
                                      SDL_PIXELFORMAT_ARGB8888,
                                      SDL_TEXTUREACCESS_STREAMING,
-                                     GB_LCD_WIDTH, GB_LCD_HEIGHT);
+                                     GB_LCD_WIDTH * cpu_scale,
+                                     GB_LCD_HEIGHT * cpu_scale);
      if (ctx->canvas == NULL) {
           fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
           die();
      }
 
-     SDL_memset(&want, 0, sizeof(want));
-     want.freq = GB_SPU_SAMPLE_RATE_HZ;
-     want.format = AUDIO_S16SYS;
-     want.channels = 2;
-     want.samples = GB_SPU_SAMPLE_BUFFER_LENGTH;
-     want.callback = gb_sdl_audio_callback;
-     want.userdata = gb;
+     ctx->audio_device = 0;
+
+     if (gb->spu.output_enabled) {
+          SDL_memset(&want, 0, sizeof(want));
+          want.freq = gb->spu.sample_rate;
+          want.format = AUDIO_S16SYS;
+          want.channels = 2;
+          /* Small chunks to keep the latency low, the ring absorbs the
+           * jitter */
+          want.samples = GB_SPU_SYNC_FRAMES;
+          want.callback = gb_sdl_audio_callback;
+          want.userdata = gb;
+
+          ctx->audio_device = SDL_OpenAudioDevice(NULL, 0,
+                                                  &want, &ctx->audio_spec,
+                                                  0 /* No changes allowed */);
+          if (ctx->audio_device == 0) {
+               fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n",
+                       SDL_GetError());
+               die();
+          }
 
-     ctx->audio_device = SDL_OpenAudioDevice(NULL, 0,
-                                             &want, &ctx->audio_spec,
-                                             0 /* No changes allowed */);
-     if (ctx->audio_device == 0) {
-          fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
-          die();
+          /* Start audio */
+          SDL_PauseAudioDevice(ctx->audio_device, 0);
      }
 
-     /* Start audio */
-     SDL_PauseAudioDevice(ctx->audio_device, 0);
-
-     gb->frontend.draw_line_dmg = gb_sdl_draw_line_dmg;
-     gb->frontend.draw_line_gbc = gb_sdl_draw_line_gbc;
+     gb->frontend.fb.format = GB_PIXEL_XRGB8888;
      gb->frontend.flip = gb_sdl_flip;
      gb->frontend.refresh_input = gb_sdl_refresh_input;
      gb->frontend.destroy = gb_sdl_destroy;
 
-     /* Clear the canvas */
-     memset(ctx->pixels, 0, sizeof(ctx->pixels));
+     if (!ctx->direct) {
+          /* The GPU renders at the native resolution into `frame` and we
+           * copy or upscale it on flip */
+          ctx->frame = calloc(GB_LCD_WIDTH * GB_LCD_HEIGHT,
+                              sizeof(*ctx->frame));
+          if (ctx->frame == NULL) {
+               perror("Malloc failed");
+               die();
+          }
+
+          gb->frontend.fb.pixels = ctx->frame;
+          gb->frontend.fb.pitch = GB_LCD_WIDTH * sizeof(*ctx->frame);
+     } else {
+          /* Clear the canvas */
+          gb_sdl_lock_canvas(gb, &pixels, &pitch);
+
+          for (y = 0; y < GB_LCD_HEIGHT; y++) {
+               memset((uint8_t *)pixels + y * pitch, 0,
+                      GB_LCD_WIDTH * sizeof(uint32_t));
+          }
+     }
+
      gb_sdl_flip(gb);
 
-     ctx->controller = NULL;
      gb_sdl_find_controller(gb);
 }
@@ -1,7 +1,8 @@
 #ifndef _GB_SDL_H_
 #define _GB_SDL_H_
 
-void gb_sdl_frontend_init(struct gb *gb);
+void gb_sdl_frontend_init(struct gb *gb, unsigned cpu_scale, bool scale2x,
+                          bool vsync, bool read_back);
 void gb_sdl_frontend_destroy(struct gb *gb);
 
 #endif /* _GB_SDL_H_ */
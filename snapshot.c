@@ -0,0 +1,440 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "gb.h"
+
+#define GB_SNAPSHOT_MAGIC "GBSNAP\r\n"
+
+/* Host configuration the emulated state depends on. A snapshot made with other
+ * settings wouldn't resume the way a run from power on does, so it must match
+ * exactly. */
+struct gb_snapshot_host {
+     /* Time source of the RTC */
+     uint64_t rtc_clock_time;
+     uint32_t rtc_clock;
+     /* `rtc_save_crc` of the cartridge */
+     uint32_t rtc_save_crc;
+     /* Audio output */
+     uint32_t sample_rate;
+     uint8_t output_enabled;
+     uint8_t blep_enabled;
+     uint8_t dc_filter;
+     /* The hash log's audio CRC is carried over */
+     uint8_t hash_log;
+     /* Frame buffer contents */
+     uint32_t fb_format;
+     uint8_t color_corrected;
+     uint8_t pad[3];
+};
+
+struct gb_snapshot_header {
+     char magic[8];
+     uint32_t version;
+     /* GB_BUILD_ID of the build that made the snapshot, NUL terminated */
+     char build_id[GB_SNAPSHOT_BUILD_ID_SIZE];
+     /* sizeof(struct gb) */
+     uint32_t layout;
+     struct gb_snapshot_host host;
+     /* CRC32C and length of the ROM */
+     uint32_t rom_crc;
+     uint32_t rom_length;
+     /* Size of the memory blocks following the state */
+     uint32_t iram_size;
+     uint32_t vram_size;
+     uint32_t cart_ram_length;
+     /* Line size of the frame buffer stored after the memory */
+     uint32_t fb_line_size;
+     /* Audio CRC of the current frame if the hash log is enabled */
+     uint32_t hash_audio_crc;
+     /* Size of the band-limited synthesis buffer stored after the frame
+      * buffer, 0 if it's not used */
+     uint32_t blep_size;
+     /* CRC32C of everything following the header */
+     uint32_t crc;
+     /* Seconds counted by the RTC, see `gb_snapshot_apply` */
+     uint64_t rtc_elapsed;
+};
+
+/* Copy GB_BUILD_ID to `id`, truncated and with the characters that aren't
+ * safe in a file name replaced */
+static void gb_snapshot_build_id(char id[GB_SNAPSHOT_BUILD_ID_SIZE]) {
+     unsigned i;
+
+     /* Zero-padded since it's compared with memcmp */
+     memset(id, 0, GB_SNAPSHOT_BUILD_ID_SIZE);
+     snprintf(id, GB_SNAPSHOT_BUILD_ID_SIZE, "%s", GB_BUILD_ID);
+
+     for (i = 0; id[i]; i++) {
+          char c = id[i];
+
+          if (!isalnum((unsigned char)c) && c != '.' && c != '-') {
+               id[i] = '_';
+          }
+     }
+}
+
+/* Fill `host` with the current configuration of the host */
+static void gb_snapshot_host(struct gb *gb, struct gb_snapshot_host *host) {
+     const struct gb_spu *spu = &gb->spu;
+
+     /* Zero-padded since it's compared with memcmp */
+     memset(host, 0, sizeof(*host));
+     host->rtc_clock_time = gb->cart.rtc.clock_time;
+     host->rtc_clock = gb->cart.rtc.clock;
+     host->rtc_save_crc = gb->cart.rtc_save_crc;
+     host->sample_rate = spu->sample_rate;
+     host->output_enabled = spu->output_enabled;
+     host->blep_enabled = spu->blep_enabled;
+     host->dc_filter = spu->dc_filter;
+     host->hash_log = gb->hash_log != NULL;
+     host->fb_format = gb->frontend.fb.format;
+     host->color_corrected = gb_color_corrected;
+}
+
+/* Returns the path of the snapshot taken after `frames` frames in directory
+ * `dir`. Since it's a function of the ROM, of the contents of the cart RAM and
+ * of the host configuration it must be called right after the cartridge has
+ * been loaded. The returned string must be freed by the caller. */
+char *gb_snapshot_path(struct gb *gb, const char *dir, unsigned frames) {
+     struct gb_cart *cart = &gb->cart;
+     uint32_t ram_crc = gb_crc32c(0, cart->ram, cart->ram_length);
+     struct gb_snapshot_host host;
+     uint32_t host_crc;
+     char build_id[GB_SNAPSHOT_BUILD_ID_SIZE];
+     char *path;
+     int len;
+
+     gb_snapshot_build_id(build_id);
+     gb_snapshot_host(gb, &host);
+     host_crc = gb_crc32c(0, &host, sizeof(host));
+
+     len = snprintf(NULL, 0, "%s/%08x-%u-%08x-%08x-%s-v%u-%u.snap", dir,
+                    cart->image->crc, cart->rom_length, ram_crc, host_crc,
+                    build_id, GB_SNAPSHOT_VERSION, frames);
+
+     path = malloc(len + 1);
+     if (path == NULL) {
+          perror("malloc failed");
+          die();
+     }
+
+     snprintf(path, len + 1, "%s/%08x-%u-%08x-%08x-%s-v%u-%u.snap", dir,
+              cart->image->crc, cart->rom_length, ram_crc, host_crc,
+              build_id, GB_SNAPSHOT_VERSION, frames);
+
+     return path;
+}
+
+/* Save the state of the emulator to `path`. Must be called between two calls
+ * to `gb_cpu_run_cycles`. Returns 0 on success, -1 on error. */
+int gb_snapshot_save(struct gb *gb, const char *path) {
+     const struct gb_framebuffer *fb = &gb->frontend.fb;
+     struct gb_snapshot_header hdr;
+     unsigned iram_size = GB_IRAM_SIZE(gb->gbc);
+     unsigned vram_size = GB_VRAM_SIZE(gb->gbc);
+     unsigned line_size = gb_framebuffer_line_size(fb);
+     unsigned blep_size = 0;
+     size_t body_size;
+     uint8_t *body;
+     uint8_t *p;
+     char *tmp_path;
+     FILE *f;
+     unsigned y;
+     int ret = -1;
+
+     /* Finish drawing the lines queued so far */
+     gb_gpu_render_flush(gb);
+
+     if (gb->spu.output_enabled && gb->spu.blep_enabled) {
+          blep_size = GB_BLEP_DELTAS_FRAMES * sizeof(*gb->spu.blep.deltas);
+     }
+
+     body_size = sizeof(*gb) + iram_size + vram_size + gb->cart.ram_length +
+          line_size * GB_LCD_HEIGHT + blep_size;
+
+     body = malloc(body_size);
+     tmp_path = malloc(strlen(path) + 32);
+     if (body == NULL || tmp_path == NULL) {
+          perror("malloc failed");
+          goto out;
+     }
+
+     /* The pointers in there are meaningless once saved, only the emulated
+      * state is ever restored */
+     p = body;
+     memcpy(p, gb, sizeof(*gb));
+     p += sizeof(*gb);
+     memcpy(p, gb->iram, iram_size);
+     p += iram_size;
+     memcpy(p, gb->vram, vram_size);
+     p += vram_size;
+     if (gb->cart.ram_length) {
+          memcpy(p, gb->cart.ram, gb->cart.ram_length);
+          p += gb->cart.ram_length;
+     }
+
+     /* The snapshot is generally taken in the middle of a frame, we need the
+      * lines drawn so far */
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          memcpy(p, (const uint8_t *)fb->pixels + y * fb->pitch, line_size);
+          p += line_size;
+     }
+
+     /* The tail of the steps added before the snapshot */
+     if (blep_size) {
+          memcpy(p, gb->spu.blep.deltas, blep_size);
+          p += blep_size;
+     }
+
+     memset(&hdr, 0, sizeof(hdr));
+     memcpy(hdr.magic, GB_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+     hdr.version = GB_SNAPSHOT_VERSION;
+     gb_snapshot_build_id(hdr.build_id);
+     hdr.layout = sizeof(*gb);
+     gb_snapshot_host(gb, &hdr.host);
+     hdr.rom_crc = gb->cart.image->crc;
+     hdr.rom_length = gb->cart.rom_length;
+     hdr.iram_size = iram_size;
+     hdr.vram_size = vram_size;
+     hdr.cart_ram_length = gb->cart.ram_length;
+     hdr.fb_line_size = line_size;
+     hdr.hash_audio_crc = gb->hash_log ? gb->hash_log->audio_crc : 0;
+     hdr.blep_size = blep_size;
+     hdr.crc = gb_crc32c(0, body, body_size);
+     hdr.rtc_elapsed = gb->cart.has_rtc ? gb_rtc_elapsed(gb) : 0;
+
+     /* Several jobs may race to create the same snapshot, each one writes its
+      * own file and renames it atomically */
+     sprintf(tmp_path, "%s.%ld.tmp", path, (long)getpid());
+
+     f = fopen(tmp_path, "wb");
+     if (f == NULL) {
+          fprintf(stderr, "Can't create snapshot '%s': %s\n",
+                  tmp_path, strerror(errno));
+          goto out;
+     }
+
+     if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+         fwrite(body, body_size, 1, f) != 1) {
+          perror("Can't write snapshot");
+          fclose(f);
+          unlink(tmp_path);
+          goto out;
+     }
+
+     if (fclose(f) != 0) {
+          perror("Can't write snapshot");
+          unlink(tmp_path);
+          goto out;
+     }
+
+     if (rename(tmp_path, path) < 0) {
+          perror("Can't rename snapshot");
+          unlink(tmp_path);
+          goto out;
+     }
+
+     ret = 0;
+
+out:
+     free(tmp_path);
+     free(body);
+     return ret;
+}
+
+/* Restore the emulated state from `s`, leaving everything related to the host
+ * (frontend, output, threads...) untouched. The host configuration must be the
+ * same as when the snapshot was made. `rtc_elapsed` is the value of the RTC
+ * when the snapshot was made. */
+static void gb_snapshot_apply(struct gb *gb, const struct gb *s,
+                              uint64_t rtc_elapsed) {
+     struct gb_cart *cart = &gb->cart;
+     struct gb_gpu *gpu = &gb->gpu;
+     struct gb_spu *spu = &gb->spu;
+     struct gb_gpu_renderer *renderer = gpu->renderer;
+     struct gb_video_capture *video_capture = gpu->video_capture;
+
+     gb->cpu = s->cpu;
+     gb->timestamp = s->timestamp;
+     gb->irq = s->irq;
+     gb->double_speed = s->double_speed;
+     gb->iram_high_bank = s->iram_high_bank;
+     gb->vram_high_bank = s->vram_high_bank;
+     gb->speed_switch_pending = s->speed_switch_pending;
+     gb->sync = s->sync;
+     memcpy(gb->zram, s->zram, sizeof(gb->zram));
+
+     cart->cur_rom_bank = s->cart.cur_rom_bank;
+     cart->mbc1_bank_ram = s->cart.mbc1_bank_ram;
+     cart->ram_write_protected = s->cart.ram_write_protected;
+     cart->cur_ram_bank = s->cart.cur_ram_bank;
+     /* The time source is part of the host's configuration. `base` and
+      * `halt_date` only make sense for the time source of the snapshot, they
+      * are recomputed below once the emulated time has been restored */
+     cart->rtc.latch = s->cart.rtc.latch;
+     cart->rtc.latched_date = s->cart.rtc.latched_date;
+
+     *gpu = s->gpu;
+     gpu->renderer = renderer;
+     gpu->video_capture = video_capture;
+     gpu->vram_dirty = true;
+     /* The palette depends on the frontend's pixel format */
+     gb_gpu_fb_palette_reload(gb);
+
+     gb->input.dpad_state = s->input.dpad_state;
+     gb->input.dpad_selected = s->input.dpad_selected;
+     gb->input.buttons_state = s->input.buttons_state;
+     gb->input.buttons_selected = s->input.buttons_selected;
+
+     gb->dma = s->dma;
+     gb->hdma = s->hdma;
+     gb->timer = s->timer;
+
+     spu->enable = s->spu.enable;
+     spu->output_level = s->spu.output_level;
+     spu->sound_mux = s->spu.sound_mux;
+     memcpy(spu->sound_amp, s->spu.sound_amp, sizeof(spu->sound_amp));
+     spu->nr1 = s->spu.nr1;
+     spu->nr2 = s->spu.nr2;
+     spu->nr3 = s->spu.nr3;
+     spu->nr4 = s->spu.nr4;
+     spu->sample_period = s->spu.sample_period;
+     spu->sample_phase = s->spu.sample_phase;
+     spu->sync_frames = s->spu.sync_frames;
+     memcpy(spu->blep_level, s->spu.blep_level, sizeof(spu->blep_level));
+     memcpy(spu->dc_prev_in, s->spu.dc_prev_in, sizeof(spu->dc_prev_in));
+     memcpy(spu->dc_prev_out, s->spu.dc_prev_out, sizeof(spu->dc_prev_out));
+     if (spu->output_enabled && spu->blep_enabled) {
+          spu->blep.factor = s->spu.blep.factor;
+          spu->blep.offset = s->spu.blep.offset;
+          memcpy(spu->blep.integrator, s->spu.blep.integrator,
+                 sizeof(spu->blep.integrator));
+     }
+
+     /* Keep the date of the RTC, under our own time source */
+     if (cart->has_rtc) {
+          gb_rtc_set_elapsed(gb, rtc_elapsed);
+     }
+}
+
+/* Restore the state saved in `path` by `gb_snapshot_save`. The snapshot is
+ * validated before anything is modified, and it's either restored completely
+ * or not at all. Returns 0 on success, -1 if the snapshot doesn't exist or
+ * can't be used. */
+int gb_snapshot_load(struct gb *gb, const char *path) {
+     const struct gb_framebuffer *fb = &gb->frontend.fb;
+     struct gb_snapshot_header hdr;
+     struct gb_snapshot_host host;
+     char build_id[GB_SNAPSHOT_BUILD_ID_SIZE];
+     unsigned iram_size = GB_IRAM_SIZE(gb->gbc);
+     unsigned vram_size = GB_VRAM_SIZE(gb->gbc);
+     unsigned line_size = gb_framebuffer_line_size(fb);
+     unsigned blep_size = 0;
+     struct gb *s = NULL;
+     uint8_t *body = NULL;
+     const uint8_t *p;
+     size_t body_size;
+     FILE *f;
+     unsigned y;
+     int ret = -1;
+
+     f = fopen(path, "rb");
+     if (f == NULL) {
+          if (errno != ENOENT) {
+               fprintf(stderr, "Can't open snapshot '%s': %s\n",
+                       path, strerror(errno));
+          }
+          return -1;
+     }
+
+     gb_snapshot_build_id(build_id);
+     gb_snapshot_host(gb, &host);
+
+     if (gb->spu.output_enabled && gb->spu.blep_enabled) {
+          blep_size = GB_BLEP_DELTAS_FRAMES * sizeof(*gb->spu.blep.deltas);
+     }
+
+     if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+         memcmp(hdr.magic, GB_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+         hdr.version != GB_SNAPSHOT_VERSION ||
+         memcmp(hdr.build_id, build_id, sizeof(build_id)) != 0 ||
+         hdr.layout != sizeof(*gb)) {
+          fprintf(stderr, "Snapshot '%s' was made by another build\n", path);
+          goto out;
+     }
+
+     if (memcmp(&hdr.host, &host, sizeof(host)) != 0 ||
+         hdr.fb_line_size != line_size ||
+         hdr.blep_size != blep_size) {
+          fprintf(stderr, "Snapshot '%s' was made with another configuration\n",
+                  path);
+          goto out;
+     }
+
+     if (hdr.rom_crc != gb->cart.image->crc ||
+         hdr.rom_length != gb->cart.rom_length ||
+         hdr.iram_size != iram_size ||
+         hdr.vram_size != vram_size ||
+         hdr.cart_ram_length != gb->cart.ram_length) {
+          fprintf(stderr, "Snapshot '%s' doesn't match the ROM\n", path);
+          goto out;
+     }
+
+     body_size = sizeof(*gb) + iram_size + vram_size + gb->cart.ram_length +
+          line_size * GB_LCD_HEIGHT + blep_size;
+
+     body = malloc(body_size);
+     s = gb_alloc();
+     if (body == NULL || s == NULL) {
+          perror("malloc failed");
+          goto out;
+     }
+
+     if (fread(body, body_size, 1, f) != 1 ||
+         gb_crc32c(0, body, body_size) != hdr.crc) {
+          fprintf(stderr, "Snapshot '%s' is corrupt\n", path);
+          goto out;
+     }
+
+     /* Everything checks out, we can modify the state */
+     p = body;
+     memcpy(s, p, sizeof(*s));
+     p += sizeof(*s);
+
+     gb_snapshot_apply(gb, s, hdr.rtc_elapsed);
+
+     memcpy(gb->iram, p, iram_size);
+     p += iram_size;
+     memcpy(gb->vram, p, vram_size);
+     p += vram_size;
+     if (gb->cart.ram_length) {
+          if (memcmp(gb->cart.ram, p, gb->cart.ram_length) != 0) {
+               memcpy(gb->cart.ram, p, gb->cart.ram_length);
+               gb->cart.dirty_ram = true;
+               gb->cart.dirty_pages = ~0ULL;
+          }
+          p += gb->cart.ram_length;
+     }
+
+     for (y = 0; y < GB_LCD_HEIGHT; y++) {
+          memcpy((uint8_t *)fb->pixels + y * fb->pitch, p, line_size);
+          p += line_size;
+     }
+
+     if (blep_size) {
+          memcpy(gb->spu.blep.deltas, p, blep_size);
+     }
+
+     if (gb->hash_log) {
+          gb->hash_log->audio_crc = hdr.hash_audio_crc;
+     }
+
+     ret = 0;
+
+out:
+     fclose(f);
+     free(body);
+     free(s);
+     return ret;
+}
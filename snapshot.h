@@ -0,0 +1,24 @@
+#ifndef _GB_SNAPSHOT_H_
+#define _GB_SNAPSHOT_H_
+
+/* Snapshots of the emulated state, used to skip the boot sequence of batch
+ * jobs which all start the same way. A snapshot is only valid for the build
+ * that created it: any change to the emulation could make the resumed runs
+ * diverge from a run from power on. The build is identified by GB_BUILD_ID,
+ * set by the Makefile from the git revision and a checksum of the sources.
+ * GB_SNAPSHOT_VERSION only tracks the format of the file. */
+#define GB_SNAPSHOT_VERSION 5
+
+#ifndef GB_BUILD_ID
+/* Built without the Makefile, we can't tell the builds apart */
+#define GB_BUILD_ID "unknown"
+#endif
+
+/* Maximum length of the build ID stored in the snapshots */
+#define GB_SNAPSHOT_BUILD_ID_SIZE 64
+
+char *gb_snapshot_path(struct gb *gb, const char *dir, unsigned frames);
+int gb_snapshot_save(struct gb *gb, const char *path);
+int gb_snapshot_load(struct gb *gb, const char *path);
+
+#endif /* _GB_SNAPSHOT_H_ */
@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "gb.h"
 
 void gb_spu_update_sound_amp(struct gb *gb) {
@@ -21,6 +25,10 @@ void gb_spu_update_sound_amp(struct gb *gb) {
 
      for (sound = 0; sound < 4; sound++) {
           unsigned channel;
+          int16_t old_amp[2] = {
+               spu->sound_amp[sound][0],
+               spu->sound_amp[sound][1],
+          };
 
           for (channel = 0; channel < 2; channel++) {
                bool enabled = spu->sound_mux & (1 << (sound + channel * 4));
@@ -36,6 +44,17 @@ void gb_spu_update_sound_amp(struct gb *gb) {
 
                spu->sound_amp[sound][channel] = amp;
           }
+
+          if (spu->blep_enabled) {
+               /* The output of this sound changes right now (the caller must
+                * have synchronized the SPU) */
+               int32_t level = spu->blep_level[sound];
+               int32_t delta_l = spu->sound_amp[sound][0] - old_amp[0];
+               int32_t delta_r = spu->sound_amp[sound][1] - old_amp[1];
+
+               gb_blep_add_delta(&spu->blep, 0,
+                                 level * delta_l, level * delta_r);
+          }
      }
 }
 
@@ -124,47 +143,47 @@ void gb_spu_duration_reload(struct gb_spu_duration *d,
 static bool gb_spu_duration_update(struct gb_spu_duration *d,
                                    unsigned duration_max,
                                    unsigned cycles) {
-     bool elapsed = false;
+     uint32_t full;
 
      if (!d->enable) {
           return false;
      }
 
-     while (cycles) {
-          if (d->counter > cycles) {
-               d->counter -= cycles;
-               cycles = 0;
-          } else {
-               /* Counter reached 0 */
-               elapsed = true;
-               cycles -= d->counter;
-               /* I'm not entirely sure about this but apparently when the
-                * counter elapses it's reloaded with the max possible value
-                * (maybe because it wraps around? */
-               gb_spu_duration_reload(d, duration_max, 0);
-          }
+     if (d->counter > cycles) {
+          d->counter -= cycles;
+          return false;
      }
 
-     return elapsed;
+     /* Counter reached 0. I'm not entirely sure about this but apparently when
+      * the counter elapses it's reloaded with the max possible value (maybe
+      * because it wraps around?) */
+     cycles -= d->counter;
+     gb_spu_duration_reload(d, duration_max, 0);
+     full = d->counter;
+     d->counter = full - cycles % full;
+
+     return true;
 }
 
 /* Update the frequency counter and return the number of times it ran out */
 static unsigned gb_spu_frequency_update(struct gb_spu_divider *f,
                                         unsigned cycles) {
-     unsigned count = 0;
+     unsigned count;
+     uint32_t period;
 
-     while (cycles) {
-          if (f->counter > cycles) {
-               f->counter -= cycles;
-               cycles = 0;
-          } else {
-               count++;
-               cycles -= f->counter;
-               /* Reload counter */
-               gb_spu_frequency_reload(f);
-          }
+     if (f->counter > cycles) {
+          f->counter -= cycles;
+          return 0;
      }
 
+     cycles -= f->counter;
+     /* Reload counter */
+     gb_spu_frequency_reload(f);
+     period = f->counter;
+
+     count = 1 + cycles / period;
+     f->counter = period - cycles % period;
+
      return count;
 }
 
@@ -185,46 +204,49 @@ static unsigned gb_spu_sweep_update(struct gb_spu_sweep *s,
       * since the frequency changes with the sweep */
      while (cycles) {
           unsigned to_run = cycles;
+          uint16_t delta;
 
-          if (s->counter < to_run) {
-               to_run = s->counter;
+          if (s->counter > to_run) {
+               s->counter -= to_run;
+               count += gb_spu_frequency_update(&s->divider, to_run);
+               break;
           }
 
-          if (s->divider.counter < to_run) {
-               to_run = s->divider.counter;
-          }
+          to_run = s->counter;
 
-          s->counter -= to_run;
-          if (s->counter == 0) {
-               /* Sweep step elapsed */
-               uint16_t delta = s->divider.offset >> s->shift;
-
-               if (s->subtract) {
-                    /* If we're subtracting and the shift value is zero or it
-                     * would overflow we do nothing and the divider offset is
-                     * not changed */
-                    if (s->shift != 0 && delta <= s->divider.offset) {
-                         s->divider.offset -= delta;
-                    }
-               } else {
-                    uint32_t o = s->divider.offset;
+          /* Run the divider up to the cycle before the sweep step with the
+           * current frequency */
+          count += gb_spu_frequency_update(&s->divider, to_run - 1);
+
+          /* Sweep step elapsed */
+          delta = s->divider.offset >> s->shift;
 
-                    o += delta;
+          if (s->subtract) {
+               /* If we're subtracting and the shift value is zero or it
+                * would overflow we do nothing and the divider offset is
+                * not changed */
+               if (s->shift != 0 && delta <= s->divider.offset) {
+                    s->divider.offset -= delta;
+               }
+          } else {
+               uint32_t o = s->divider.offset;
 
-                    if (o > 0x7ff) {
-                         /* If the addition overflows the sound is disabled */
-                         *disable = true;
-                         break;
-                    }
+               o += delta;
 
-                    s->divider.offset = o;
+               if (o > 0x7ff) {
+                    /* If the addition overflows the sound is disabled */
+                    *disable = true;
+                    break;
                }
 
-               /* Reload counter */
-               s->counter = 0x8000 * s->time;
+               s->divider.offset = o;
           }
 
-          count += gb_spu_frequency_update(&s->divider, to_run);
+          /* Reload counter */
+          s->counter = 0x8000 * s->time;
+
+          /* If the divider reloads on this cycle it uses the new frequency */
+          count += gb_spu_frequency_update(&s->divider, 1);
           cycles -= to_run;
      }
 
@@ -232,22 +254,22 @@ static unsigned gb_spu_sweep_update(struct gb_spu_sweep *s,
 }
 
 #define GB_SPU_NPHASES 16
+static const uint8_t gb_spu_waveforms[4][GB_SPU_NPHASES / 2] = {
+     /* 1/8 */
+     { 1, 0, 0, 0, 0, 0, 0, 0},
+     /* 1/4 */
+     { 1, 1, 0, 0, 0, 0, 0, 0},
+     /* 1/2 */
+     { 1, 1, 1, 1, 0, 0, 0, 0},
+     /* 3/4 */
+     { 1, 1, 1, 1, 1, 1, 0, 0},
+};
+
 static uint8_t gb_spu_next_wave_sample(struct gb_spu_rectangle_wave *wave,
                                        unsigned phase_steps) {
-     static const uint8_t waveforms[4][GB_SPU_NPHASES / 2] = {
-          /* 1/8 */
-          { 1, 0, 0, 0, 0, 0, 0, 0},
-          /* 1/4 */
-          { 1, 1, 0, 0, 0, 0, 0, 0},
-          /* 1/2 */
-          { 1, 1, 1, 1, 0, 0, 0, 0},
-          /* 3/4 */
-          { 1, 1, 1, 1, 1, 1, 0, 0},
-     };
-
      wave->phase = (wave->phase + phase_steps) % GB_SPU_NPHASES;
 
-     return waveforms[wave->duty_cycle][wave->phase / 2];
+     return gb_spu_waveforms[wave->duty_cycle][wave->phase / 2];
 }
 
 static void gb_spu_envelope_reload_counter(struct gb_spu_envelope *e) {
@@ -272,25 +294,26 @@ static bool gb_spu_envelope_active(struct gb_spu_envelope *e) {
  * inactive state and the channel should be disabled. */
 static bool gb_spu_envelope_update(struct gb_spu_envelope *e, unsigned cycles) {
      if (e->step_duration != 0) {
-          while (cycles) {
-               if (e->counter > cycles) {
-                    e->counter -= cycles;
-                    cycles = 0;
+          if (e->counter > cycles) {
+               e->counter -= cycles;
+          } else {
+               /* Step counter elapsed at least once, apply envelope
+                * function */
+               uint32_t full;
+               unsigned steps;
+
+               cycles -= e->counter;
+               gb_spu_envelope_reload_counter(e);
+               full = e->counter;
+
+               steps = 1 + cycles / full;
+               e->counter = full - cycles % full;
+
+               if (e->increment) {
+                    e->value = (e->value + steps > 0xf) ?
+                         0xf : e->value + steps;
                } else {
-                    /* Step counter elapsed, apply envelope function */
-                    cycles -= e->counter;
-
-                    if (e->increment) {
-                         if (e->value < 0xf) {
-                              e->value++;
-                         }
-                    } else {
-                         if (e->value > 0) {
-                              e->value--;
-                         }
-                    }
-
-                    gb_spu_envelope_reload_counter(e);
+                    e->value = (steps >= e->value) ? 0 : e->value - steps;
                }
           }
      }
@@ -425,9 +448,10 @@ static void gb_spu_lfsr_step(struct gb_spu_nr4 *nr4) {
      }
 }
 
-static uint8_t gb_spu_next_nr4_sample(struct gb *gb, unsigned cycles) {
+/* Update the duration counter and envelope of sound 4 and return true if it's
+ * still running */
+static bool gb_spu_nr4_update_state(struct gb *gb, unsigned cycles) {
      struct gb_spu *spu = &gb->spu;
-     uint8_t sample;
 
      /* The duration counter runs even if the sound itself is not running */
      if (gb_spu_duration_update(&spu->nr4.duration,
@@ -437,14 +461,21 @@ static uint8_t gb_spu_next_nr4_sample(struct gb *gb, unsigned cycles) {
      }
 
      if (!spu->nr4.running) {
-          return 0;
+          return false;
      }
 
      if (gb_spu_envelope_update(&spu->nr4.envelope, cycles)) {
           spu->nr4.running = false;
      }
 
-     if (!spu->nr4.running) {
+     return spu->nr4.running;
+}
+
+static uint8_t gb_spu_next_nr4_sample(struct gb *gb, unsigned cycles) {
+     struct gb_spu *spu = &gb->spu;
+     uint8_t sample;
+
+     if (!gb_spu_nr4_update_state(gb, cycles)) {
           return 0;
      }
 
@@ -467,89 +498,712 @@ static uint8_t gb_spu_next_nr4_sample(struct gb *gb, unsigned cycles) {
      return sample;
 }
 
-/* Send a pair of left/right samples to the frontend */
-static void gb_spu_send_sample_to_frontend(struct gb *gb,
-                                           int16_t sample_l, int16_t sample_r) {
+/* Initialize the audio output: `frames` is the size of the ring in sample
+ * frames and `rate` the output sample rate. If `rate` is 0 we point-sample the
+ * sounds at GB_SPU_SAMPLE_RATE_HZ, otherwise we use band-limited synthesis at
+ * the requested rate. If `frames` is 0 there's no ring, the samples are only
+ * sent to the audio capture (if any). If this function is not called no
+ * sample is generated. */
+void gb_spu_output_init(struct gb *gb, unsigned frames, unsigned rate) {
      struct gb_spu *spu = &gb->spu;
-     struct gb_spu_sample_buffer *buf;
+     struct gb_spu_ring *ring = &spu->ring;
+     unsigned size = 0;
+
+     if (frames) {
+          /* Round up to a power of two so that we can wrap around with a
+           * mask */
+          size = 1;
+          while (size < frames) {
+               size <<= 1;
+          }
 
-     buf = &spu->buffers[spu->buffer_index];
+          ring->samples = calloc(size, sizeof(*ring->samples));
+          if (ring->samples == NULL) {
+               perror("Can't allocate audio ring");
+               die();
+          }
+     } else {
+          ring->samples = NULL;
+     }
 
-     if (spu->sample_index == 0) {
-          /* We're about to fill the first sample, make sure that the
-           * buffer is free. If it's not this will pause the thread until
-           * the frontend frees it, effectively synchronizing us with audio
-           */
-          sem_wait(&buf->free);
+     ring->size = size;
+     atomic_init(&ring->head, 0);
+     atomic_init(&ring->tail, 0);
+     atomic_init(&ring->underruns, 0);
+     atomic_init(&ring->overruns, 0);
+     atomic_init(&ring->min_fill, size);
+     sem_init(&ring->consumed, 0, 0);
+
+     /* The sample clock is not reset by `gb_spu_reset` since the game can
+      * reset the SPU at any time by disabling it */
+     if (rate == 0) {
+          spu->blep_enabled = false;
+          spu->sample_rate = GB_SPU_SAMPLE_RATE_HZ;
+          spu->nominal_period = GB_SPU_SAMPLE_PERIOD;
+     } else {
+          spu->blep_enabled = true;
+          spu->sample_rate = rate;
+          spu->nominal_period =
+               ((uint64_t)GB_CPU_FREQ_HZ << GB_SPU_PERIOD_SHIFT) / rate;
+          gb_blep_init(&spu->blep, rate);
+          memset(spu->blep_level, 0, sizeof(spu->blep_level));
      }
 
-     buf->samples[spu->sample_index][0] = sample_l;
-     buf->samples[spu->sample_index][1] = sample_r;
+     spu->sample_period = spu->nominal_period;
+     spu->drc_integral = 0;
+     spu->sample_phase = 0;
+     spu->sync_frames = 0;
+     spu->output_enabled = true;
+
+     spu->dc_prev_in[0] = spu->dc_prev_in[1] = 0;
+     spu->dc_prev_out[0] = spu->dc_prev_out[1] = 0;
+}
+
+void gb_spu_output_destroy(struct gb *gb) {
+     struct gb_spu *spu = &gb->spu;
+
+     if (!spu->output_enabled) {
+          return;
+     }
 
-     spu->sample_index++;
-     if (spu->sample_index == GB_SPU_SAMPLE_BUFFER_LENGTH) {
-          /* We're done with this buffer */
-          sem_post(&buf->ready);
-          /* Move on to the next one */
-          spu->buffer_index = (spu->buffer_index + 1)
-               % GB_SPU_SAMPLE_BUFFER_COUNT;
-          spu->sample_index = 0;
+     if (spu->blep_enabled) {
+          gb_blep_destroy(&spu->blep);
      }
+
+     gb_audio_capture_close(gb);
+
+     sem_destroy(&spu->ring.consumed);
+     free(spu->ring.samples);
+     spu->ring.samples = NULL;
 }
 
-void gb_spu_sync(struct gb *gb) {
+/* Returns the number of frames currently waiting in the ring */
+unsigned gb_spu_ring_fill(struct gb_spu_ring *ring) {
+     return atomic_load_explicit(&ring->head, memory_order_acquire) -
+          atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/* Called by the frontend to fetch up to `frames` frames from the ring. Returns
+ * the number of frames actually copied to `out`. */
+unsigned gb_spu_ring_read(struct gb_spu_ring *ring, int16_t (*out)[2],
+                          unsigned frames) {
+     unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+     unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+     unsigned fill = head - tail;
+     unsigned pos = tail & (ring->size - 1);
+     unsigned n;
+     unsigned first;
+
+     /* The frontend starts reading before the emulation has produced
+      * anything, the statistics only start with the first samples */
+     if (head != 0 &&
+         fill < atomic_load_explicit(&ring->min_fill, memory_order_relaxed)) {
+          atomic_store_explicit(&ring->min_fill, fill, memory_order_relaxed);
+     }
+
+     n = frames;
+     if (n > fill) {
+          if (head != 0) {
+               atomic_fetch_add_explicit(&ring->underruns, 1,
+                                         memory_order_relaxed);
+          }
+          n = fill;
+     }
+
+     /* We may have to wrap around the end of the buffer */
+     first = ring->size - pos;
+     if (first > n) {
+          first = n;
+     }
+
+     memcpy(out, ring->samples + pos, first * sizeof(*out));
+     memcpy(out + first, ring->samples, (n - first) * sizeof(*out));
+
+     atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+     sem_post(&ring->consumed);
+
+     return n;
+}
+
+/* Block until there's room for at least `frames` frames in the ring. Must not
+ * be called while the SPU is in the middle of a sync. */
+void gb_spu_ring_wait(struct gb_spu_ring *ring, unsigned frames) {
+     while (ring->size - gb_spu_ring_fill(ring) < frames) {
+          sem_wait(&ring->consumed);
+     }
+}
+
+void gb_spu_ring_print_stats(struct gb_spu_ring *ring) {
+     printf("Audio ring: %u frames, lowest fill %u, %u underruns, "
+            "%u frames dropped\n",
+            ring->size,
+            atomic_load(&ring->min_fill),
+            atomic_load(&ring->underruns),
+            atomic_load(&ring->overruns));
+}
+
+/* Send `n` frames to the frontend, the audio capture and the hash log */
+static void gb_spu_send_to_frontend(struct gb *gb,
+                                    const int16_t (*frames)[2], unsigned n) {
+     struct gb_spu_ring *ring = &gb->spu.ring;
+     unsigned head;
+     unsigned tail;
+     unsigned room;
+     unsigned pos;
+     unsigned first;
+
+     if (gb->spu.audio_capture) {
+          gb_capture_write(&gb->spu.audio_capture->stream,
+                           frames, n * sizeof(*frames));
+     }
+
+     if (gb->hash_log) {
+          gb_hash_log_audio(gb, frames, n);
+     }
+
+     if (ring->size == 0) {
+          /* No ring, the samples are only captured */
+          return;
+     }
+
+     head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+     tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+     room = ring->size - (head - tail);
+     pos = head & (ring->size - 1);
+
+     if (n > room) {
+          /* The ring is full, the frontend isn't keeping up. We never wait
+           * here since we're in the middle of the emulation, see
+           * gb_spu_ring_wait. */
+          atomic_fetch_add_explicit(&ring->overruns, n - room,
+                                    memory_order_relaxed);
+          n = room;
+     }
+
+     /* We may have to wrap around the end of the buffer */
+     first = ring->size - pos;
+     if (first > n) {
+          first = n;
+     }
+
+     memcpy(ring->samples + pos, frames, first * sizeof(*frames));
+     memcpy(ring->samples, frames + first, (n - first) * sizeof(*frames));
+
+     atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+/* Mix the output levels of the four sounds for `n` samples into the `acc`
+ * accumulators of both stereo channels, using the scaling computed by
+ * `gb_spu_update_sound_amp` */
+static void gb_spu_mix(struct gb_spu *spu,
+                       uint8_t levels[4][GB_SPU_BLOCK_FRAMES], unsigned n,
+                       int32_t acc[2][GB_SPU_BLOCK_FRAMES]) {
+     unsigned k = 0;
+     unsigned sound;
+
+#ifdef __SSE2__
+     /* 8 samples at a time. The levels are 4 bits and the amplification
+      * factors are small enough for the products to fit in 16 bits */
+     const __m128i zero = _mm_setzero_si128();
+
+     for (; k + 8 <= n; k += 8) {
+          __m128i l_lo = zero;
+          __m128i l_hi = zero;
+          __m128i r_lo = zero;
+          __m128i r_hi = zero;
+
+          for (sound = 0; sound < 4; sound++) {
+               const __m128i *src = (const __m128i *)(levels[sound] + k);
+               __m128i amp_l = _mm_set1_epi16(spu->sound_amp[sound][0]);
+               __m128i amp_r = _mm_set1_epi16(spu->sound_amp[sound][1]);
+               __m128i v;
+               __m128i pl, pr;
+
+               v = _mm_unpacklo_epi8(_mm_loadl_epi64(src), zero);
+
+               pl = _mm_mullo_epi16(v, amp_l);
+               pr = _mm_mullo_epi16(v, amp_r);
+
+               l_lo = _mm_add_epi32(l_lo, _mm_unpacklo_epi16(pl, zero));
+               l_hi = _mm_add_epi32(l_hi, _mm_unpackhi_epi16(pl, zero));
+               r_lo = _mm_add_epi32(r_lo, _mm_unpacklo_epi16(pr, zero));
+               r_hi = _mm_add_epi32(r_hi, _mm_unpackhi_epi16(pr, zero));
+          }
+
+          _mm_storeu_si128((__m128i *)(acc[0] + k), l_lo);
+          _mm_storeu_si128((__m128i *)(acc[0] + k + 4), l_hi);
+          _mm_storeu_si128((__m128i *)(acc[1] + k), r_lo);
+          _mm_storeu_si128((__m128i *)(acc[1] + k + 4), r_hi);
+     }
+#endif
+
+     for (; k < n; k++) {
+          int32_t l = 0;
+          int32_t r = 0;
+
+          for (sound = 0; sound < 4; sound++) {
+               l += levels[sound][k] * spu->sound_amp[sound][0];
+               r += levels[sound][k] * spu->sound_amp[sound][1];
+          }
+
+          acc[0][k] = l;
+          acc[1][k] = r;
+     }
+}
+
+/* First order DC-blocking high-pass filter: y[n] = x[n] - x[n-1] + R * y[n-1].
+ * The SPU's output is always positive and games often leave a channel
+ * enabled with a constant level, removing the DC offset avoids wasting
+ * headroom and pops when the level changes. */
+static void gb_spu_dc_filter(struct gb_spu *spu,
+                             int32_t acc[2][GB_SPU_BLOCK_FRAMES], unsigned n) {
+     unsigned channel;
+     unsigned k;
+
+     for (channel = 0; channel < 2; channel++) {
+          int32_t prev_in = spu->dc_prev_in[channel];
+          int32_t prev_out = spu->dc_prev_out[channel];
+
+          for (k = 0; k < n; k++) {
+               int32_t x = acc[channel][k];
+               int32_t y;
+
+               y = x - prev_in +
+                    (int32_t)(((int64_t)prev_out * GB_SPU_DC_FILTER_R) >> 15);
+
+               prev_in = x;
+               prev_out = y;
+               acc[channel][k] = y;
+          }
+
+          spu->dc_prev_in[channel] = prev_in;
+          spu->dc_prev_out[channel] = prev_out;
+     }
+}
+
+/* Final output stage: filter the accumulators if needed, saturate them to 16
+ * bits, interleave the stereo channels and send them to the frontend */
+static void gb_spu_output(struct gb *gb,
+                          int32_t acc[2][GB_SPU_BLOCK_FRAMES], unsigned n) {
      struct gb_spu *spu = &gb->spu;
-     int32_t elapsed = gb_sync_resync(gb, GB_SYNC_SPU);
-     int32_t frac;
-     int32_t nsamples;
-     int32_t next_sync;
+     int16_t frames[GB_SPU_BLOCK_FRAMES][2];
+     unsigned k = 0;
 
-     frac = spu->sample_period_frac;
-     elapsed += frac;
+     if (spu->dc_filter) {
+          gb_spu_dc_filter(spu, acc, n);
+     }
 
-     nsamples = elapsed / GB_SPU_SAMPLE_RATE_DIVISOR;
+#ifdef __SSE2__
+     for (; k + 8 <= n; k += 8) {
+          __m128i l = _mm_packs_epi32(
+               _mm_loadu_si128((const __m128i *)(acc[0] + k)),
+               _mm_loadu_si128((const __m128i *)(acc[0] + k + 4)));
+          __m128i r = _mm_packs_epi32(
+               _mm_loadu_si128((const __m128i *)(acc[1] + k)),
+               _mm_loadu_si128((const __m128i *)(acc[1] + k + 4)));
+
+          _mm_storeu_si128((__m128i *)frames[k], _mm_unpacklo_epi16(l, r));
+          _mm_storeu_si128((__m128i *)frames[k + 4], _mm_unpackhi_epi16(l, r));
+     }
+#endif
 
-     while (nsamples--) {
-          int32_t next_sample_delay = GB_SPU_SAMPLE_RATE_DIVISOR - frac;
-          unsigned sound;
-          int16_t sound_samples[4];
-          int16_t sample_l = 0;
-          int16_t sample_r = 0;
+     for (; k < n; k++) {
+          unsigned channel;
+
+          for (channel = 0; channel < 2; channel++) {
+               int32_t v = acc[channel][k];
+
+               if (v > INT16_MAX) {
+                    v = INT16_MAX;
+               } else if (v < INT16_MIN) {
+                    v = INT16_MIN;
+               }
+
+               frames[k][channel] = v;
+          }
+     }
+
+     gb_spu_send_to_frontend(gb, (const int16_t (*)[2])frames, n);
+}
+
+typedef uint8_t (*gb_spu_next_sample_f)(struct gb *gb, unsigned cycles);
+
+static const gb_spu_next_sample_f gb_spu_next_sample[4] = {
+     gb_spu_next_nr1_sample,
+     gb_spu_next_nr2_sample,
+     gb_spu_next_nr3_sample,
+     gb_spu_next_nr4_sample,
+};
+
+static uint32_t gb_spu_duration_next_event(struct gb_spu_duration *d) {
+     return d->enable ? d->counter : UINT32_MAX;
+}
+
+static uint32_t gb_spu_envelope_next_event(struct gb_spu_envelope *e) {
+     return e->step_duration ? e->counter : UINT32_MAX;
+}
+
+static uint32_t gb_spu_min(uint32_t a, uint32_t b) {
+     return a < b ? a : b;
+}
+
+/* Number of cycles between two steps of a frequency divider */
+static uint32_t gb_spu_divider_period(struct gb_spu_divider *d) {
+     return 2 * (0x800U - d->offset);
+}
+
+/* Returns the number of cycles until the next edge of a rectangle wave, i.e.
+ * the next time its output actually changes */
+static uint32_t gb_spu_wave_next_edge(struct gb_spu_rectangle_wave *wave,
+                                     struct gb_spu_divider *d) {
+     const uint8_t *waveform = gb_spu_waveforms[wave->duty_cycle];
+     uint8_t cur = waveform[wave->phase / 2];
+     unsigned steps = 1;
+
+     while (waveform[((wave->phase + steps) % GB_SPU_NPHASES) / 2] == cur) {
+          steps++;
+     }
+
+     return d->counter + (steps - 1) * gb_spu_divider_period(d);
+}
+
+/* Returns the number of cycles until the next time the output of sound 3
+ * actually changes */
+static uint32_t gb_spu_nr3_next_edge(struct gb_spu_nr3 *nr3) {
+     unsigned nsamples = GB_NR3_RAM_SIZE * 2;
+     unsigned steps;
+     uint8_t cur = 0;
+
+     for (steps = 0; steps < nsamples; steps++) {
+          unsigned index = (nr3->index + steps) % nsamples;
+          uint8_t sample = nr3->ram[index / 2];
+
+          if (index & 1) {
+               sample &= 0xf;
+          } else {
+               sample >>= 4;
+          }
+
+          sample >>= nr3->volume_shift - 1;
+
+          if (steps == 0) {
+               cur = sample;
+          } else if (sample != cur) {
+               break;
+          }
+     }
+
+     if (steps == nsamples) {
+          /* Flat wave, the output never changes */
+          return UINT32_MAX;
+     }
+
+     return nr3->divider.counter +
+          (steps - 1) * gb_spu_divider_period(&nr3->divider);
+}
 
-          sound_samples[0] = gb_spu_next_nr1_sample(gb, next_sample_delay);
-          sound_samples[1] = gb_spu_next_nr2_sample(gb, next_sample_delay);
-          sound_samples[2] = gb_spu_next_nr3_sample(gb, next_sample_delay);
-          sound_samples[3] = gb_spu_next_nr4_sample(gb, next_sample_delay);
+/* Returns the number of cycles until the output of `sound` may change. Events
+ * that don't affect the output (such as a phase step of a rectangle wave that
+ * is not an edge) are skipped, the state of the sound is still correctly
+ * updated since the `gb_spu_next_nrX_sample` functions can run for any
+ * number of cycles. */
+static uint32_t gb_spu_next_event(struct gb *gb, unsigned sound) {
+     struct gb_spu *spu = &gb->spu;
+     uint32_t next;
+
+     switch (sound) {
+     case 0:
+          next = gb_spu_duration_next_event(&spu->nr1.duration);
+          if (spu->nr1.running) {
+               struct gb_spu_sweep *sweep = &spu->nr1.sweep;
+
+               next = gb_spu_min(next, gb_spu_envelope_next_event(
+                                      &spu->nr1.envelope));
+               if (sweep->time) {
+                    /* The sweep changes the frequency and may disable the
+                     * sound */
+                    next = gb_spu_min(next, sweep->counter);
+               }
+               if (spu->nr1.envelope.value != 0) {
+                    next = gb_spu_min(next,
+                                      gb_spu_wave_next_edge(&spu->nr1.wave,
+                                                            &sweep->divider));
+               }
+          }
+          return next;
+     case 1:
+          next = gb_spu_duration_next_event(&spu->nr2.duration);
+          if (spu->nr2.running) {
+               next = gb_spu_min(next, gb_spu_envelope_next_event(
+                                      &spu->nr2.envelope));
+               if (spu->nr2.envelope.value != 0) {
+                    next = gb_spu_min(next,
+                                      gb_spu_wave_next_edge(&spu->nr2.wave,
+                                                            &spu->nr2.divider));
+               }
+          }
+          return next;
+     case 2:
+          next = gb_spu_duration_next_event(&spu->nr3.duration);
+          if (spu->nr3.running && spu->nr3.volume_shift != 0) {
+               next = gb_spu_min(next, gb_spu_nr3_next_edge(&spu->nr3));
+          }
+          return next;
+     default:
+          next = gb_spu_duration_next_event(&spu->nr4.duration);
+          if (spu->nr4.running) {
+               next = gb_spu_min(next, gb_spu_envelope_next_event(
+                                      &spu->nr4.envelope));
+               if (spu->nr4.envelope.value != 0) {
+                    /* We can't easily predict the LFSR's output so we have to
+                     * stop at every step */
+                    next = gb_spu_min(next, spu->nr4.counter);
+               }
+          }
+          return next;
+     }
+}
+
+/* Run `sound` for `cycles` and record all its output transitions in the BLEP
+ * buffer */
+static void gb_spu_blep_run(struct gb *gb, unsigned sound, uint32_t cycles) {
+     struct gb_spu *spu = &gb->spu;
+     gb_spu_next_sample_f next_sample = gb_spu_next_sample[sound];
+     uint32_t t = 0;
+     uint32_t run;
+     /* A register write may have changed the output since the last sync */
+     uint8_t level = next_sample(gb, 0);
+
+     for (;;) {
+          if (level != spu->blep_level[sound]) {
+               int32_t delta = (int32_t)level - spu->blep_level[sound];
+
+               gb_blep_add_delta(&spu->blep, t,
+                                 delta * spu->sound_amp[sound][0],
+                                 delta * spu->sound_amp[sound][1]);
+               spu->blep_level[sound] = level;
+          }
+
+          if (t == cycles) {
+               break;
+          }
+
+          run = gb_spu_min(gb_spu_next_event(gb, sound), cycles - t);
+          level = next_sample(gb, run);
+          t += run;
+     }
+}
+
+/* The BLEP output is processed by the same output stage */
+_Static_assert(GB_BLEP_BUFFER_FRAMES <= GB_SPU_BLOCK_FRAMES,
+               "BLEP buffer doesn't fit in an output block");
+
+/* Band-limited synthesis: run the sounds from transition to transition and
+ * send the resulting samples to the frontend */
+static void gb_spu_blep_sync(struct gb *gb, int32_t elapsed) {
+     struct gb_spu *spu = &gb->spu;
+     int32_t acc[2][GB_SPU_BLOCK_FRAMES];
+     uint32_t max_cycles;
+     uint64_t next_sync;
+
+     /* Pick up any rate adjustment */
+     gb_blep_set_period(&spu->blep, spu->sample_period);
+     max_cycles = gb_blep_max_frame_cycles(&spu->blep);
+
+     while (elapsed > 0) {
+          uint32_t cycles = gb_spu_min(elapsed, max_cycles);
+          unsigned sound;
+          unsigned n;
 
           for (sound = 0; sound < 4; sound++) {
-               sample_l += sound_samples[sound] * spu->sound_amp[sound][0];
-               sample_r += sound_samples[sound] * spu->sound_amp[sound][1];
+               gb_spu_blep_run(gb, sound, cycles);
+          }
+
+          n = gb_blep_end_frame(&spu->blep, cycles, acc[0], acc[1]);
+          gb_spu_output(gb, acc, n);
+
+          elapsed -= cycles;
+     }
+
+     /* Schedule a sync to feed the ring with the next batch of samples */
+     next_sync = ((uint64_t)GB_SPU_SYNC_FRAMES * spu->sample_period) >>
+          GB_SPU_PERIOD_SHIFT;
+     gb_sync_next(gb, GB_SYNC_SPU, next_sync);
+}
+
+/* Run `sound` for `cycles` and write its output level at each of the `n`
+ * sample `times` to `out`. The sound only needs to be stepped when an event
+ * changes its output, in between the level is constant. */
+static void gb_spu_sound_run(struct gb *gb, unsigned sound, uint32_t cycles,
+                             const uint32_t *times, unsigned n,
+                             uint8_t *out) {
+     gb_spu_next_sample_f next_sample = gb_spu_next_sample[sound];
+     uint32_t t = 0;
+     unsigned k = 0;
+     uint8_t level = next_sample(gb, 0);
+
+     for (;;) {
+          uint32_t run = gb_spu_min(gb_spu_next_event(gb, sound), cycles - t);
+
+          /* The output doesn't change until the next event */
+          while (k < n && times[k] - t < run) {
+               out[k++] = level;
           }
 
-          gb_spu_send_sample_to_frontend(gb, sample_l, sample_r);
+          if (run == 0) {
+               /* We reached the end, samples taken exactly at `cycles` */
+               while (k < n) {
+                    out[k++] = level;
+               }
+               break;
+          }
 
-          frac = 0;
+          level = next_sample(gb, run);
+          t += run;
      }
+}
 
-     /* See if we have any leftover fractional sample */
-     frac = elapsed % GB_SPU_SAMPLE_RATE_DIVISOR;
+/* Point-sample the sounds every `sample_period` */
+static void gb_spu_point_sync(struct gb *gb, int32_t elapsed) {
+     struct gb_spu *spu = &gb->spu;
+     uint32_t period = spu->sample_period;
+     uint32_t times[GB_SPU_BLOCK_FRAMES];
+     uint8_t levels[4][GB_SPU_BLOCK_FRAMES];
+     int32_t acc[2][GB_SPU_BLOCK_FRAMES];
+     uint64_t next_sync;
+
+     do {
+          uint32_t t = 0;
+          uint32_t cycles;
+          unsigned sound;
+          unsigned n;
+
+          /* Compute the time of all the samples in this block */
+          for (n = 0; n < GB_SPU_BLOCK_FRAMES; n++) {
+               uint32_t next_sample_delay;
+
+               /* Number of cycles until the next sample, rounded up. The phase
+                * can be greater than the period if the period was just
+                * reduced by the rate control */
+               if (spu->sample_phase < period) {
+                    next_sample_delay =
+                         (period - spu->sample_phase +
+                          (1U << GB_SPU_PERIOD_SHIFT) - 1) >>
+                         GB_SPU_PERIOD_SHIFT;
+               } else {
+                    next_sample_delay = 0;
+               }
 
-     /* Advance the SPU state even if we don't want the sample yet in order to
-      * have the correct value for the `running` flags */
-     gb_spu_next_nr1_sample(gb, frac);
-     gb_spu_next_nr2_sample(gb, frac);
-     gb_spu_next_nr3_sample(gb, frac);
-     gb_spu_next_nr4_sample(gb, frac);
+               if (t + next_sample_delay > (uint32_t)elapsed) {
+                    break;
+               }
 
-     spu->sample_period_frac = frac;
+               t += next_sample_delay;
+               times[n] = t;
 
-     /* Schedule a sync to fill the current buffer */
-     next_sync = (GB_SPU_SAMPLE_BUFFER_LENGTH - spu->sample_index) *
-          GB_SPU_SAMPLE_RATE_DIVISOR;
-     next_sync -= frac;
+               spu->sample_phase +=
+                    next_sample_delay << GB_SPU_PERIOD_SHIFT;
+               spu->sample_phase -= period;
+               spu->sync_frames = (spu->sync_frames + 1) % GB_SPU_SYNC_FRAMES;
+          }
+
+          if (n == GB_SPU_BLOCK_FRAMES) {
+               /* Block is full, stop at the last sample and loop */
+               cycles = t;
+          } else {
+               /* Advance the SPU state even if we don't want the next sample
+                * yet in order to have the correct value for the `running`
+                * flags */
+               cycles = elapsed;
+               spu->sample_phase += (cycles - t) << GB_SPU_PERIOD_SHIFT;
+          }
+
+          for (sound = 0; sound < 4; sound++) {
+               gb_spu_sound_run(gb, sound, cycles, times, n, levels[sound]);
+          }
+
+          gb_spu_mix(spu, levels, n, acc);
+          gb_spu_output(gb, acc, n);
+
+          elapsed -= cycles;
+     } while (elapsed > 0);
+
+     /* Schedule a sync to feed the ring with the next batch of samples */
+     next_sync = (uint64_t)(GB_SPU_SYNC_FRAMES - spu->sync_frames) * period;
+     if (next_sync > spu->sample_phase) {
+          next_sync -= spu->sample_phase;
+     } else {
+          next_sync = 0;
+     }
+     next_sync = (next_sync + (1U << GB_SPU_PERIOD_SHIFT) - 1)
+          >> GB_SPU_PERIOD_SHIFT;
      gb_sync_next(gb, GB_SYNC_SPU, next_sync);
 }
 
+/* Audio output is disabled: we only update the state visible through the
+ * registers (running flags, duration counters, envelopes and sweep). All of
+ * these can be advanced by any number of cycles in one go, so we don't need
+ * to be called until a register is accessed. The LFSR is not stepped since it
+ * only affects the output. */
+static void gb_spu_state_sync(struct gb *gb, int32_t elapsed) {
+     gb_spu_next_nr1_sample(gb, elapsed);
+     gb_spu_next_nr2_sample(gb, elapsed);
+     gb_spu_next_nr3_sample(gb, elapsed);
+     gb_spu_nr4_update_state(gb, elapsed);
+
+     gb_sync_next(gb, GB_SYNC_SPU, GB_SYNC_NEVER);
+}
+
+void gb_spu_sync(struct gb *gb) {
+     int32_t elapsed = gb_sync_resync(gb, GB_SYNC_SPU);
+
+     if (!gb->spu.output_enabled) {
+          gb_spu_state_sync(gb, elapsed);
+     } else if (gb->spu.blep_enabled) {
+          gb_spu_blep_sync(gb, elapsed);
+     } else {
+          gb_spu_point_sync(gb, elapsed);
+     }
+}
+
+/* Dynamic rate control: instead of blocking the emulation when the audio ring
+ * is full we slightly tweak the sample rate in order to keep the ring about
+ * half full. If the ring fills up we generate fewer samples, if it drains we
+ * generate more. The deviation is small enough not to be audible.
+ *
+ * The correction is the sum of a proportional term and of its integral. On
+ * its own the proportional term only compensates the rate mismatch between
+ * the display and the Game Boy by leaving the ring off-center (almost full
+ * for a 60Hz display), the integral slowly converges to the mismatch so that
+ * the ring settles at half full. */
+void gb_spu_drc_update(struct gb *gb) {
+     struct gb_spu *spu = &gb->spu;
+     const int64_t integral_max =
+          (int64_t)GB_SPU_DRC_MAX_DELTA_PPM * GB_SPU_DRC_INTEGRAL_STEPS;
+     int64_t target = spu->ring.size / 2;
+     int64_t fill = gb_spu_ring_fill(&spu->ring);
+     int64_t ppm;
+
+     ppm = GB_SPU_DRC_MAX_DELTA_PPM * (fill - target) / target;
+
+     spu->drc_integral += ppm;
+     if (spu->drc_integral > integral_max) {
+          spu->drc_integral = integral_max;
+     } else if (spu->drc_integral < -integral_max) {
+          spu->drc_integral = -integral_max;
+     }
+
+     ppm += spu->drc_integral / GB_SPU_DRC_INTEGRAL_STEPS;
+     if (ppm > GB_SPU_DRC_MAX_DELTA_PPM) {
+          ppm = GB_SPU_DRC_MAX_DELTA_PPM;
+     } else if (ppm < -GB_SPU_DRC_MAX_DELTA_PPM) {
+          ppm = -GB_SPU_DRC_MAX_DELTA_PPM;
+     }
+
+     spu->sample_period = spu->nominal_period +
+          (int64_t)spu->nominal_period * ppm / 1000000;
+}
+
 void gb_spu_nr1_start(struct gb *gb) {
      struct gb_spu *spu = &gb->spu;
 
@@ -8,26 +8,62 @@
 /* Effective sample rate for the frontend */
 #define GB_SPU_SAMPLE_RATE_HZ (GB_CPU_FREQ_HZ / GB_SPU_SAMPLE_RATE_DIVISOR)
 
-/* Number of sample frames bufferized. Each frame contains two samples for the
- * left and right stereo channels */
-#define GB_SPU_SAMPLE_BUFFER_LENGTH 2048
+/* The sample period is stored as a fixed point number of cycles with this many
+ * fractional bits in order to be able to tweak the sample rate very slightly */
+#define GB_SPU_PERIOD_SHIFT 16
 
-/* Number of entries in the sample buffer ring */
-#define GB_SPU_SAMPLE_BUFFER_COUNT 2
+/* Sample period of the point sampler, in fixed point */
+#define GB_SPU_SAMPLE_PERIOD \
+     ((uint32_t)GB_SPU_SAMPLE_RATE_DIVISOR << GB_SPU_PERIOD_SHIFT)
+
+/* Maximum deviation from the nominal sample rate in dynamic rate control mode,
+ * in parts per million. Must be large enough to absorb the difference between
+ * the Game Boy refresh rate (~59.73Hz) and a 60Hz display */
+#define GB_SPU_DRC_MAX_DELTA_PPM 5000
+/* Number of `gb_spu_drc_update` calls over which the error of the ring fill
+ * is integrated (about 8.5s at 120 calls per second). Shorter makes the rate
+ * control oscillate */
+#define GB_SPU_DRC_INTEGRAL_STEPS 1024
+
+/* Default size of the audio ring in sample frames. Each frame contains two
+ * samples for the left and right stereo channels */
+#define GB_SPU_RING_DEFAULT_FRAMES 2048
+
+/* Number of sample frames generated between two forced synchronizations.
+ * This is how often the ring is fed with fresh samples while the CPU runs */
+#define GB_SPU_SYNC_FRAMES 512
+
+/* Maximum number of samples point-sampled in one go */
+#define GB_SPU_BLOCK_FRAMES 1024
+
+/* Feedback coefficient of the DC-blocking filter in 1.15 fixed point (about
+ * 0.995, which gives a cutoff frequency around 50Hz at 65536Hz) */
+#define GB_SPU_DC_FILTER_R 32604
 
 /* Sound 3 RAM size in bytes */
 #define GB_NR3_RAM_SIZE  16
 
-struct gb_spu_sample_buffer {
-     /* Buffer of pairs of stereo samples */
-     int16_t samples[GB_SPU_SAMPLE_BUFFER_LENGTH][2];
-     /* Semaphore set to 1 when the frontend is done sending the audio buffer
-      * and reset to 0 when the SPU starts filling it with new samples. */
-     sem_t free;
-     /* Semaphore set to 1 when the SPU is done filling a buffer and it can be
-      * sent by the frontend. Set to 0 by the frontend when it starts sending
-      * the samples. */
-     sem_t ready;
+/* Single-producer, single-consumer ring buffer used to send the samples to the
+ * frontend. The SPU is the only writer of `head` and the frontend the only
+ * writer of `tail`, so no lock is needed. */
+struct gb_spu_ring {
+     /* Buffer of pairs of stereo samples, `size` frames long */
+     int16_t (*samples)[2];
+     /* Number of frames in `samples`, always a power of two */
+     unsigned size;
+     /* Total number of frames written by the SPU (wraps around) */
+     atomic_uint head;
+     /* Total number of frames consumed by the frontend (wraps around) */
+     atomic_uint tail;
+     /* Posted by the frontend every time it consumes samples. Used to wait for
+      * room in the ring when it's full. */
+     sem_t consumed;
+     /* Number of times the frontend wanted more samples than were available */
+     atomic_uint underruns;
+     /* Number of frames dropped because the ring was full */
+     atomic_uint overruns;
+     /* Lowest fill level seen by the frontend before a read, in frames */
+     atomic_uint min_fill;
 };
 
 /* Duration works the same for all 4 sounds but the max values are different */
@@ -160,9 +196,23 @@ struct gb_spu {
       * registers except for sound 3's RAM */
      bool enable;
 
-     /* Leftover cycles from the previous sync if it left a number of cycles
-      * less than GB_SPU_SAMPLE_RATE_DIVISOR */
-     uint8_t sample_period_frac;
+     /* True if we generate audio samples for the frontend. If false only the
+      * state visible through the registers is emulated */
+     bool output_enabled;
+     /* Output sample rate in Hz */
+     unsigned sample_rate;
+     /* Delay between two samples at `sample_rate` in fixed point cycles (see
+      * GB_SPU_PERIOD_SHIFT) */
+     uint32_t nominal_period;
+     /* Current delay between two samples in fixed point cycles. Normally
+      * `nominal_period` but it can be slightly adjusted by
+      * `gb_spu_drc_update` */
+     uint32_t sample_period;
+     /* Sum of the proportional corrections (in ppm) of the dynamic rate
+      * control, which converges to the actual rate mismatch */
+     int64_t drc_integral;
+     /* Fixed point number of cycles elapsed since the last sample */
+     uint32_t sample_phase;
 
      /* NR50 register */
      uint8_t output_level;
@@ -181,12 +231,27 @@ struct gb_spu {
      /* Sound 4 state */
      struct gb_spu_nr4 nr4;
 
-     /* Audio buffer exchanged with the frontend */
-     struct gb_spu_sample_buffer buffers[GB_SPU_SAMPLE_BUFFER_COUNT];
-     /* Buffer being currently filled up with fresh samples */
-     unsigned buffer_index;
-     /* Position within the current buffer */
-     unsigned sample_index;
+     /* Audio samples exchanged with the frontend */
+     struct gb_spu_ring ring;
+     /* Audio capture, or NULL if the samples aren't captured */
+     struct gb_audio_capture *audio_capture;
+     /* Number of frames generated since the last forced synchronization */
+     unsigned sync_frames;
+
+     /* If true we use band-limited synthesis at `sample_rate` instead of
+      * point sampling the sounds at GB_SPU_SAMPLE_RATE_HZ */
+     bool blep_enabled;
+     /* Band-limited synthesis buffer */
+     struct gb_blep blep;
+     /* Last output level of each sound, used to compute the transitions */
+     uint8_t blep_level[4];
+
+     /* True if the DC-blocking filter is applied to the output */
+     bool dc_filter;
+     /* Previous input and output of the DC-blocking filter for both stereo
+      * channels */
+     int32_t dc_prev_in[2];
+     int32_t dc_prev_out[2];
 };
 
 void gb_spu_reset(struct gb *gb);
@@ -200,5 +265,13 @@ void gb_spu_duration_reload(struct gb_spu_duration *d,
                             unsigned duration_max,
                             uint8_t t1);
 void gb_spu_sweep_reload(struct gb_spu_sweep *f, uint8_t conf);
+void gb_spu_output_init(struct gb *gb, unsigned frames, unsigned rate);
+void gb_spu_output_destroy(struct gb *gb);
+unsigned gb_spu_ring_fill(struct gb_spu_ring *ring);
+unsigned gb_spu_ring_read(struct gb_spu_ring *ring, int16_t (*out)[2],
+                          unsigned frames);
+void gb_spu_ring_wait(struct gb_spu_ring *ring, unsigned frames);
+void gb_spu_ring_print_stats(struct gb_spu_ring *ring);
+void gb_spu_drc_update(struct gb *gb);
 
 #endif /* _SPU_H_ */
@@ -12,6 +12,7 @@ void gb_sync_reset(struct gb *gb) {
 
      gb->timestamp = 0;
      sync->first_event = 0;
+     sync->epoch = 0;
 }
 
 int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token) {
@@ -90,5 +91,11 @@ void gb_sync_rebase(struct gb *gb) {
      }
 
      sync->first_event -= gb->timestamp;
+     sync->epoch += gb->timestamp;
      gb->timestamp = 0;
 }
+
+/* Returns the number of cycles elapsed since power on */
+uint64_t gb_sync_cycles(struct gb *gb) {
+     return gb->sync.epoch + gb->timestamp;
+}
@@ -22,6 +22,8 @@ struct gb_sync {
      int32_t last_sync[GB_SYNC_NUM];
      /* Value of the timestamp the next time this token must be synchronized */
      int32_t next_event[GB_SYNC_NUM];
+     /* Number of cycles elapsed since power on when the timestamp was 0 */
+     uint64_t epoch;
 };
 
 void gb_sync_reset(struct gb *gb);
@@ -32,5 +34,6 @@ int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token);
 void gb_sync_next(struct gb *gb, enum gb_sync_token token, int32_t cycles);
 void gb_sync_check_events(struct gb *gb);
 void gb_sync_rebase(struct gb *gb);
+uint64_t gb_sync_cycles(struct gb *gb);
 
 #endif /* _GB_SYNC_H_ */